@@ -38,6 +38,8 @@ Descriptor BRIEF::calc_descriptor(const SSPoint& p) const {
 	vector<bool> bits(n, false);
 	auto pixel = [&](int r, int c) {
 		const float* ptr = img.ptr(r, c);
+		if (img.channels() == 1)
+			return ptr[0];
 		return (ptr[0] + ptr[1] + ptr[2]) / 3;
 	};
 	REP(i, n) {
@@ -18,20 +18,28 @@ namespace pano {
 
 // return half-shifted image coordinate
 vector<Descriptor> FeatureDetector::detect_feature(const Mat32f& img) const {
+	return detect_feature(img, img.width(), img.height());
+}
+
+vector<Descriptor> FeatureDetector::detect_feature(const Mat32f& img, int w, int h) const {
 	auto ret = do_detect_feature(img);
 	// convert scale-coordinate to half-offset image coordinate
 	for (auto& d: ret) {
-		d.coor.x = (d.coor.x - 0.5) * img.width();
-		d.coor.y = (d.coor.y - 0.5) * img.height();
+		d.coor.x = (d.coor.x - 0.5) * w;
+		d.coor.y = (d.coor.y - 0.5) * h;
 	}
 	return ret;
 }
 
+vector<Descriptor> FeatureDetector::detect_feature(const Matuc& img) const {
+	return detect_feature(rgb2grey(img));
+}
+
 // return [0, 1] coordinate
 vector<Descriptor> SIFTDetector::do_detect_feature(const Mat32f& mat) const {
 	// perform sift at this resolution
 	float ratio = SIFT_WORKING_SIZE * 2.0f / (mat.width() + mat.height());
-	Mat32f resized(mat.rows() * ratio, mat.cols() * ratio, 3);
+	Mat32f resized(mat.rows() * ratio, mat.cols() * ratio, mat.channels());
 	resize(mat, resized);
 
 	ScaleSpace ss(resized, NUM_OCTAVE, NUM_SCALE);
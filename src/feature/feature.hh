@@ -47,12 +47,22 @@ class FeatureDetector {
 
 		// return [-w/2,w/2] coordinated
 		std::vector<Descriptor> detect_feature(const Mat32f& img) const;
+		// img is a downscaled version of an image of shape w x h.
+		// return [-w/2,w/2] coordinated in the original image
+		std::vector<Descriptor> detect_feature(const Mat32f& img, int w, int h) const;
+		// detect on the grey image
+		std::vector<Descriptor> detect_feature(const Matuc& img) const;
 		virtual std::vector<Descriptor> do_detect_feature(const Mat32f& img) const = 0;
+
+		// the image can be downscaled to this size before detection.
+		// 0 if the full resolution is needed
+		virtual int working_size() const { return 0; }
 };
 
 class SIFTDetector : public FeatureDetector {
 	public:
 		std::vector<Descriptor> do_detect_feature(const Mat32f& img) const override;
+		int working_size() const override { return config::SIFT_WORKING_SIZE; }
 };
 
 
@@ -5,7 +5,10 @@
 #pragma once
 #include <memory>
 #include <vector>
+#include <utility>
+#include <type_traits>
 #include "lib/mat.h"
+#include "lib/half.hh"
 #include "lib/utils.hh"
 #include "lib/timer.hh"
 
@@ -26,8 +29,10 @@ class GaussianBlur {
 		GaussianBlur(float sigma): sigma(sigma), gcache(sigma) {}
 
 		// TODO faster convolution
+		// values stored in reduced precision (e.g. Half) are convolved in float
 		template <typename T>
 		Mat<T> blur(const Mat<T>& img) const {
+			typedef typename std::decay<decltype(widen(std::declval<T>()))>::type W;
 			m_assert(img.channels() == 1);
 			TotalTimer tm("gaussianblur");
 			const int w = img.width(), h = img.height();
@@ -37,20 +42,20 @@ class GaussianBlur {
 			const int center = kw / 2;
 			float * kernel = gcache.kernel;
 
-			std::vector<T> cur_line_mem(center * 2 + std::max(w, h), 0);
-			T *cur_line = cur_line_mem.data() + center;
+			std::vector<W> cur_line_mem(center * 2 + std::max(w, h), W());
+			W *cur_line = cur_line_mem.data() + center;
 
 			// apply to columns
 			REP(j, w){
 				const T* src = img.ptr(0, j);
 				// copy a column of src
 				REP(i, h) {
-					cur_line[i] = *src;
+					cur_line[i] = widen(*src);
 					src += w;
 				}
 
 				// pad the border with border value
-				T v0 = cur_line[0];
+				W v0 = cur_line[0];
 				for (int i = 1; i <= center; i ++)
 					cur_line[-i] = v0;
 				v0 = cur_line[h - 1];
@@ -59,10 +64,10 @@ class GaussianBlur {
 
 				T *dest = ret.ptr(0, j);
 				REP(i, h) {
-					T tmp{0};
+					W tmp{};
 					for (int k = -center; k <= center; k ++)
 						tmp += cur_line[i + k] * kernel[k];
-					*dest = tmp;
+					*dest = T(tmp);
 					dest += w;
 				}
 			}
@@ -70,20 +75,20 @@ class GaussianBlur {
 			// apply to rows
 			REP(i, h) {
 				T *dest = ret.ptr(i);
-				memcpy(cur_line, dest, sizeof(T) * w);
+				REP(j, w) cur_line[j] = widen(dest[j]);
 				{	// pad the border
-					T v0 = cur_line[0];
+					W v0 = cur_line[0];
 					for (int j = 1; j <= center; j ++)
 						cur_line[-j] = v0;
 					v0 = cur_line[w - 1];
 					for (int j = 0; j < center; j ++)
-						cur_line[center + j] = v0;
+						cur_line[w + j] = v0;
 				}
 				REP(j, w) {
-					T tmp{0};
+					W tmp{};
 					for (int k = -center; k <= center; k ++)
 						tmp += cur_line[j + k] * kernel[k];
-					*(dest ++) = tmp;
+					*(dest ++) = T(tmp);
 				}
 			}
 			return ret;
@@ -3,6 +3,7 @@
 // Author: Yuxin Wu <ppwwyyxxc@gmail.com>
 
 #include <limits>
+#include <map>
 #include <flann/flann.hpp>
 #include "matcher.hh"
 #include "lib/timer.hh"
@@ -19,6 +20,18 @@ namespace flann {
 }
 #endif
 
+namespace {
+// descriptors of about nr features evenly taken from feat, as rows
+vector<float> sample_descriptors(const vector<pano::Descriptor>& feat, int nr, int D) {
+	int step = max((int)feat.size() / nr, 1),
+			cnt = (feat.size() + step - 1) / step;
+	vector<float> ret(cnt * D);
+	REP(k, cnt)
+		memcpy(ret.data() + D * k, feat[k * step].descriptor.data(), D * sizeof(float));
+	return ret;
+}
+}
+
 namespace pano {
 
 MatchData FeatureMatcher::match() const {
@@ -114,4 +127,67 @@ MatchData PairWiseMatcher::match(int i, int j) const {
 	return ret;
 }
 
+int PairWiseMatcher::count_match(int i, int j, int nr_query) const {
+	static const float REJECT_RATIO_SQR = MATCH_REJECT_NEXT_RATIO * MATCH_REJECT_NEXT_RATIO;
+	vector<float> buf = sample_descriptors(feats.at(i), nr_query, D);
+	int nr = buf.size() / D;
+	flann::Matrix<float> query(buf.data(), nr, D);
+
+	vector<int> idx_buf(nr * 2);
+	vector<float> dist_buf(nr * 2);
+	flann::Matrix<int> indices(idx_buf.data(), nr, 2);
+	flann::Matrix<float> dists(dist_buf.data(), nr, 2);
+	trees[j].knnSearch(query, indices, dists, 2, flann::SearchParams(32));
+	int ret = 0;
+	REP(k, nr)
+		if (dists[k][0] <= REJECT_RATIO_SQR * dists[k][1])
+			ret ++;
+	return ret;
+}
+
+void PairWiseMatcher::build_retrieval_index(int nr_sample) {
+	GuardedTimer tm("build_retrieval_index()");
+	retrieval_buf.clear();
+	retrieval_owner.clear();
+	REP(i, (int)feats.size()) {
+		vector<float> buf = sample_descriptors(feats[i], nr_sample, D);
+		retrieval_buf.insert(retrieval_buf.end(), buf.begin(), buf.end());
+		retrieval_owner.resize(retrieval_buf.size() / D, i);
+	}
+	flann::Matrix<float> points(retrieval_buf.data(), retrieval_owner.size(), D);
+	retrieval_tree.reset(new flann::Index<pano::L2SSE>(
+				points, flann::KDTreeIndexParams(FLANN_NR_KDTREE)));
+	retrieval_tree->buildIndex();
+}
+
+vector<int> PairWiseMatcher::retrieve(int i, int nr_query, int nr_candidate) const {
+	m_assert(retrieval_tree != nullptr);
+	vector<float> buf = sample_descriptors(feats.at(i), nr_query, D);
+	int nr = buf.size() / D,
+			k = min(RETRIEVAL_NR_NEIGHBOR, (int)retrieval_owner.size());
+	flann::Matrix<float> query(buf.data(), nr, D);
+
+	vector<int> idx_buf(nr * k);
+	vector<float> dist_buf(nr * k);
+	flann::Matrix<int> indices(idx_buf.data(), nr, k);
+	flann::Matrix<float> dists(dist_buf.data(), nr, k);
+	retrieval_tree->knnSearch(query, indices, dists, k, flann::SearchParams(32));
+	map<int, int> votes;
+	for (int idx : idx_buf) {
+		if (idx < 0 || idx >= (int)retrieval_owner.size())
+			continue;		// not found
+		int owner = retrieval_owner[idx];
+		if (owner != i)
+			votes[owner] ++;
+	}
+
+	vector<pair<int, int>> sorted;	// <votes, image>
+	for (auto& v : votes) sorted.emplace_back(v.second, v.first);
+	sort(sorted.begin(), sorted.end(), greater<pair<int, int>>());
+	vector<int> ret;
+	REP(c, min(nr_candidate, (int)sorted.size()))
+		ret.emplace_back(sorted[c].second);
+	return ret;
+}
+
 }
@@ -4,6 +4,7 @@
 
 #pragma once
 #include <vector>
+#include <memory>
 #include <flann/flann.hpp>
 #include "feature.hh"
 #include "dist.hh"
@@ -49,6 +50,18 @@ class PairWiseMatcher {
 		// return pair of <idx in i, idx in j>
 		MatchData match(int i, int j) const;
 
+		// a cheap similarity between two images, for retrieval:
+		// number of matches from at most nr_query features of i, with a coarse search
+		int count_match(int i, int j, int nr_query) const;
+
+		// build an index of at most nr_sample features of every image, for retrieve()
+		void build_retrieval_index(int nr_sample);
+
+		// at most nr_candidate images which are likely to match i, by decreasing votes.
+		// each of at most nr_query features of i votes for the images of its
+		// nearest neighbors in the retrieval index
+		std::vector<int> retrieve(int i, int nr_query, int nr_candidate) const;
+
 		~PairWiseMatcher() {
 			for (auto& p: bufs) delete[] p;
 		}
@@ -60,6 +73,10 @@ class PairWiseMatcher {
 		std::vector<flann::Index<pano::L2SSE>> trees;
 		std::vector<float*> bufs;	// index buffer is managed manually
 
+		std::unique_ptr<flann::Index<pano::L2SSE>> retrieval_tree;
+		std::vector<float> retrieval_buf;
+		std::vector<int> retrieval_owner;		// image of each feature in the retrieval index
+
 		void build();
 };
 
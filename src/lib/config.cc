@@ -41,10 +41,18 @@ float FOCAL_LENGTH;
 bool ESTIMATE_CAMERA;
 bool STRAIGHTEN;
 int MAX_OUTPUT_SIZE;
+int PREVIEW_SIZE;
 bool ORDERED_INPUT;
 bool LAZY_READ;
+int PREFETCH_MEMORY;
+int IMAGE_CACHE_MEMORY;
+int PNG_COMPRESSION_LEVEL;
+int DEEPZOOM_TILE_SIZE;
+bool CHECKPOINT;
+bool GUIDED_MATCHING;
 
 int MULTIPASS_BA;
+int HIERARCHICAL_CLUSTER_SIZE;
 float LM_LAMBDA;
 
 int SIFT_WORKING_SIZE;
@@ -80,5 +88,8 @@ float INLIER_IN_POINTS_RATIO;
 float SLOPE_PLAIN;
 
 int MULTIBAND;
+bool MULTIBAND_HALF;
+bool STREAM_BLEND;
+bool BICUBIC;
 
 }
@@ -28,8 +28,15 @@ extern float FOCAL_LENGTH;
 extern bool ESTIMATE_CAMERA;
 extern bool STRAIGHTEN;
 extern int MAX_OUTPUT_SIZE;
+extern int PREVIEW_SIZE;
 extern bool ORDERED_INPUT;
 extern bool LAZY_READ;
+extern int PREFETCH_MEMORY;
+extern int IMAGE_CACHE_MEMORY;
+extern int PNG_COMPRESSION_LEVEL;
+extern int DEEPZOOM_TILE_SIZE;
+extern bool CHECKPOINT;
+extern bool GUIDED_MATCHING;
 
 extern int SIFT_WORKING_SIZE;
 extern int NUM_OCTAVE;
@@ -63,9 +70,13 @@ extern float INLIER_IN_POINTS_RATIO;
 extern float SLOPE_PLAIN;
 
 extern int MULTIPASS_BA;
+extern int HIERARCHICAL_CLUSTER_SIZE;
 extern float LM_LAMBDA;
 
 extern int MULTIBAND;
+extern bool MULTIBAND_HALF;
+extern bool STREAM_BLEND;
+extern bool BICUBIC;
 
 
 
@@ -83,5 +94,15 @@ const int BRIEF_PATH_SIZE = 9;
 const int BRIEF_NR_PAIR = 256;
 
 const int FLANN_NR_KDTREE = 6;
+const int RETRIEVAL_NR_QUERY = 100;
+const int RETRIEVAL_NR_NEIGHBOR = 5;
+const int RETRIEVAL_NR_CANDIDATE = 20;
+
+const int PREFETCH_NR_THREAD = 2;
+
+// number of output pixels rendered at once in STREAM_BLEND
+const int STREAM_STRIP_PIXELS = 1 << 22;
+// number of output columns blended at once with MULTIBAND in STREAM_BLEND
+const int STREAM_TILE_COLS = 1 << 11;
 
 }
@@ -0,0 +1,96 @@
+//File: half.hh
+
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include "color.hh"
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace pano {
+
+// IEEE 754 half precision float, only to store values in half the memory.
+// Arithmetic is done on the float it converts to, by F16C instructions if available
+class Half {
+	public:
+		Half() = default;
+		explicit Half(float f): bits(from_float(f)) {}
+		operator float() const { return to_float(bits); }
+
+	private:
+		uint16_t bits;
+
+#ifdef __F16C__
+		static uint16_t from_float(float f) { return _cvtss_sh(f, 0); }
+		static float to_float(uint16_t h) { return _cvtsh_ss(h); }
+#else
+		// round to nearest even, as F16C does
+		static uint16_t from_float(float f) {
+			uint32_t x;
+			memcpy(&x, &f, sizeof(x));
+			uint32_t sign = (x >> 16) & 0x8000, mant = x & 0x7fffff;
+			int exp = (int)((x >> 23) & 0xff) - 127 + 15;
+			if (((x >> 23) & 0xff) == 0xff)		// inf or nan
+				return sign | 0x7c00 | (mant ? 0x200 : 0);
+			if (exp >= 31)
+				return sign | 0x7c00;
+			if (exp <= 0) {		// subnormal, or too small
+				if (exp < -10)
+					return sign;
+				mant |= 0x800000;
+				int shift = 14 - exp;
+				uint32_t h = mant >> shift, rem = mant & ((1u << shift) - 1),
+								 halfway = 1u << (shift - 1);
+				if (rem > halfway || (rem == halfway && (h & 1)))
+					h ++;
+				return sign | h;
+			}
+			uint32_t h = (exp << 10) | (mant >> 13), rem = mant & 0x1fff;
+			if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+				h ++;		// may carry into the exponent, which is still right
+			return sign | h;
+		}
+
+		static float to_float(uint16_t h) {
+			uint32_t sign = (uint32_t)(h & 0x8000) << 16,
+							 exp = (h >> 10) & 0x1f, mant = h & 0x3ff, x;
+			if (exp == 0) {
+				if (mant == 0)
+					x = sign;
+				else {		// subnormal
+					exp = 127 - 15 + 1;
+					while (! (mant & 0x400)) {
+						mant <<= 1;
+						exp --;
+					}
+					x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+				}
+			} else if (exp == 31)
+				x = sign | 0x7f800000 | (mant << 13);
+			else
+				x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+			float f;
+			memcpy(&f, &x, sizeof(f));
+			return f;
+		}
+#endif
+};
+
+// a Color stored in half precision
+struct HalfColor {
+	Half x, y, z;
+
+	HalfColor() = default;
+	explicit HalfColor(const Color& c): x(c.x), y(c.y), z(c.z) {}
+	explicit operator Color() const { return Color(x, y, z); }
+};
+
+// the value to do arithmetic on, of a stored one
+inline float widen(Half v) { return v; }
+inline Color widen(const HalfColor& v) { return Color(v); }
+template <typename T>
+inline const T& widen(const T& v) { return v; }
+
+}
@@ -0,0 +1,89 @@
+//File: image_cache.cc
+
+#include "image_cache.hh"
+
+#include "lib/config.hh"
+#include "lib/debugutils.hh"
+#include "lib/imgproc.hh"
+#include "lib/utils.hh"
+using namespace std;
+
+namespace pano {
+
+ImageCache& ImageCache::instance() {
+	static ImageCache cache;
+	return cache;
+}
+
+void ImageCache::load(const string& fname, Matuc& img, vector<unsigned char>& encoded) {
+	if (take(fname, img, encoded))
+		return;
+	if (config::IMAGE_CACHE_MEMORY == 0) {
+		img = read_img_uc(fname.c_str());
+		return;
+	}
+	encoded = read_file_bytes(fname.c_str());
+	img = decode_img_uc(encoded, fname.c_str());
+}
+
+bool ImageCache::take(const string& fname, Matuc& img, vector<unsigned char>& encoded) {
+	{
+		lock_guard<mutex> lk(mtx);
+		auto itr = index.find(fname);
+		if (itr == index.end())
+			return false;
+		auto entry = itr->second;
+		used -= entry->nr_bytes();
+		img = entry->img;
+		encoded.swap(entry->encoded);
+		index.erase(itr);
+		lru.erase(entry);
+		if (img.pixels())
+			return true;
+	}
+	// decode without holding the lock
+	img = decode_img_uc(encoded, fname.c_str());
+	return true;
+}
+
+void ImageCache::put(const string& fname, Matuc img, vector<unsigned char> encoded) {
+	size_t budget = (size_t)config::IMAGE_CACHE_MEMORY << 20;
+	if (budget == 0) return;
+	lock_guard<mutex> lk(mtx);
+	auto itr = index.find(fname);
+	if (itr != index.end())
+		erase(itr->second);
+	lru.push_front(Entry{fname, img, move(encoded)});
+	index[fname] = lru.begin();
+	used += lru.front().nr_bytes();
+	shrink(budget);
+}
+
+void ImageCache::clear() {
+	lock_guard<mutex> lk(mtx);
+	lru.clear();
+	index.clear();
+	used = 0;
+}
+
+void ImageCache::erase(list<Entry>::iterator itr) {
+	used -= itr->nr_bytes();
+	index.erase(itr->fname);
+	lru.erase(itr);
+}
+
+void ImageCache::shrink(size_t budget) {
+	// spill from the oldest one, by dropping the decoded image
+	for (auto itr = lru.rbegin(); itr != lru.rend() && used > budget; ++itr) {
+		auto& e = *itr;
+		if (e.encoded.empty() || ! e.img.pixels()) continue;
+		used -= e.nr_bytes();
+		e.img = Matuc();
+		used += e.nr_bytes();
+	}
+	// still too large, drop the oldest ones
+	while (used > budget && lru.size())
+		erase(prev(lru.end()));
+}
+
+}
@@ -0,0 +1,65 @@
+//File: image_cache.hh
+
+#pragma once
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mat.h"
+
+namespace pano {
+
+// Decoded images released by their users, keyed by file name,
+// together with the file content they were decoded from.
+// Total memory is bounded by IMAGE_CACHE_MEMORY: the least recently
+// released images are reduced to their file content first,
+// which saves the disk read but not the decoding, then dropped.
+// An image taken out of the cache is owned by the caller until put back.
+class ImageCache {
+	public:
+		static ImageCache& instance();
+
+		ImageCache(const ImageCache&) = delete;
+		ImageCache& operator = (const ImageCache&) = delete;
+
+		// load the image of fname, from the cache or else from the file.
+		// its file content is moved to encoded when the cache is enabled, to be put back with it
+		void load(const std::string& fname, Matuc& img, std::vector<unsigned char>& encoded);
+
+		// move the image of fname and its file content out of the cache.
+		// the content may be empty. return false if not cached
+		bool take(const std::string& fname, Matuc& img, std::vector<unsigned char>& encoded);
+
+		// give a decoded image to the cache, with its file content if available
+		void put(const std::string& fname, Matuc img, std::vector<unsigned char> encoded);
+
+		// drop everything
+		void clear();
+
+	private:
+		ImageCache() = default;
+
+		struct Entry {
+			std::string fname;
+			Matuc img;			// empty if spilled
+			std::vector<unsigned char> encoded;		// empty if unknown
+
+			size_t nr_bytes() const {
+				return (size_t)img.pixels() * img.channels() + encoded.size();
+			}
+		};
+
+		std::mutex mtx;
+		std::list<Entry> lru;	// most recently released first
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		size_t used = 0;
+
+		void erase(std::list<Entry>::iterator itr);
+
+		// spill or drop old entries until under budget, without reading or encoding anything.
+		// requires the lock
+		void shrink(size_t budget);
+};
+
+}
@@ -2,12 +2,20 @@
 //Author: Yuxin Wu <ppwwyyxx@gmail.com>
 
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <vector>
 #define cimg_display 0
 #define cimg_use_jpeg
 #include "CImg.h"
+extern "C" {
+#include <jpeglib.h>
+}
 
 #include "imgproc.hh"
+#include "strip_writer.hh"
 #include "lib/utils.hh"
 #include "lodepng/lodepng.h"
 
@@ -16,39 +24,118 @@ using namespace std;
 
 namespace {
 
-void write_png(const char* fname, const Mat32f& mat) {
-	int n = mat.pixels();
-	vector<unsigned char> img(n * 4);
-	const float* p = mat.ptr();
-	unsigned char* data = img.data();
-	REP(i, n) {
-		data[0] = (p[0] < 0 ? 1 : p[0]) * 255;
-		data[1] = (p[1] < 0 ? 1 : p[1]) * 255;
-		data[2] = (p[2] < 0 ? 1 : p[2]) * 255;
-		data[3] = 255;
-		data += 4; p += 3;
+void jpeg_error_exit(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	error_exit(ssprintf("libjpeg error: %s", msg));
+}
+
+// decode a JPEG directly to grey, downscaled in the DCT domain.
+// return false if it's not a JPEG that libjpeg can convert to grey
+bool read_jpeg_grey(const char* fname, int min_size,
+		Mat32f& mat, int& orig_w, int& orig_h) {
+	FILE* fin = fopen(fname, "rb");
+	if (! fin)
+		error_exit(ssprintf("Cannot open \"%s\"!", fname));
+	unsigned char magic[2] = {0, 0};
+	if (fread(magic, 1, 2, fin) != 2 || magic[0] != 0xFF || magic[1] != 0xD8) {
+		fclose(fin);
+		return false;
 	}
-	unsigned error = lodepng::encode(fname, img, mat.width(), mat.height());
-	if(error)
-		error_exit(ssprintf(
-					"png encoder error %u: %s", error, lodepng_error_text(error)));
+	rewind(fin);
+
+	jpeg_decompress_struct cinfo;
+	jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_error_exit;
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, fin);
+	jpeg_read_header(&cinfo, TRUE);
+	if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(fin);
+		return false;
+	}
+	orig_w = cinfo.image_width, orig_h = cinfo.image_height;
+
+	// libjpeg supports 1/2, 1/4, 1/8 without a full IDCT
+	int denom = 1;
+	if (min_size > 0)
+		while (denom < 8 && (orig_w + orig_h) / (denom * 2) >= min_size * 2)
+			denom *= 2;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	jpeg_start_decompress(&cinfo);
+
+	int w = cinfo.output_width, h = cinfo.output_height;
+	mat = Mat32f(h, w, 1);
+	vector<unsigned char> row(w);
+	JSAMPROW rowptr = row.data();
+	const float factor = 1.f / 255;
+	while (cinfo.output_scanline < cinfo.output_height) {
+		float* dst = mat.ptr(cinfo.output_scanline);
+		jpeg_read_scanlines(&cinfo, &rowptr, 1);
+		REP(i, w) dst[i] = row[i] * factor;
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(fin);
+	return true;
 }
 
-Mat32f read_png(const char* fname) {
+bool is_jpeg(const vector<unsigned char>& bytes) {
+	return bytes.size() > 2 && bytes[0] == 0xFF && bytes[1] == 0xD8;
+}
+
+bool is_png(const vector<unsigned char>& bytes) {
+	const unsigned char magic[4] = {0x89, 'P', 'N', 'G'};
+	return bytes.size() > 4 && memcmp(bytes.data(), magic, 4) == 0;
+}
+
+// return false if it's not a JPEG that libjpeg can convert to RGB.
+// denom: 1, 2, 4 or 8 to downscale while decoding
+bool decode_jpeg(const vector<unsigned char>& bytes, Matuc& mat, int denom = 1) {
+	jpeg_decompress_struct cinfo;
+	jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_error_exit;
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, bytes.data(), bytes.size());
+	jpeg_read_header(&cinfo, TRUE);
+	if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	jpeg_start_decompress(&cinfo);
+	mat = Matuc(cinfo.output_height, cinfo.output_width, 3);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = mat.ptr(cinfo.output_scanline);
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	return true;
+}
+
+Matuc decode_png(const vector<unsigned char>& bytes) {
 	vector<unsigned char> img;
 	unsigned w, h;
-	unsigned error = lodepng::decode(img, w, h, fname);
+	unsigned error = lodepng::decode(img, w, h, bytes);
 	if (error)
 		error_exit(ssprintf(
-					"png encoder error %u: %s", error, lodepng_error_text(error)));
-	Mat32f mat(h, w, 3);
+					"png decoder error %u: %s", error, lodepng_error_text(error)));
+	Matuc mat(h, w, 3);
 	unsigned npixel = w * h;
-	float* p = mat.ptr();
+	unsigned char* p = mat.ptr();
 	unsigned char* data = img.data();
 	REP(i, npixel) {
-		*(p++) = (float)*(data++) / 255.0;
-		*(p++) = (float)*(data++) / 255.0;
-		*(p++) = (float)*(data++) / 255.0;
+		*(p++) = *(data++);
+		*(p++) = *(data++);
+		*(p++) = *(data++);
 		data++;	// rgba
 	}
 	return mat;
@@ -59,40 +146,84 @@ Mat32f read_png(const char* fname) {
 namespace pano {
 
 Mat32f read_img(const char* fname) {
+	return cvt_uc2f(read_img_uc(fname));
+}
+
+Mat32f read_img_grey(const char* fname, int min_size, int& orig_w, int& orig_h) {
 	if (! exists_file(fname))
 		error_exit(ssprintf("File \"%s\" not exists!", fname));
-	if (endswith(fname, ".png"))
-		return read_png(fname);
+	Mat32f ret;
+	if (read_jpeg_grey(fname, min_size, ret, orig_w, orig_h))
+		return ret;
+	Matuc img = read_img_uc(fname);
+	orig_w = img.width(), orig_h = img.height();
+	return rgb2grey(img);
+}
+
+Matuc read_img_uc(const char* fname) {
+	if (! exists_file(fname))
+		error_exit(ssprintf("File \"%s\" not exists!", fname));
+	return decode_img_uc(read_file_bytes(fname), fname);
+}
+
+Matuc read_img_uc(const char* fname, int level) {
+	if (! exists_file(fname))
+		error_exit(ssprintf("File \"%s\" not exists!", fname));
+	auto bytes = read_file_bytes(fname);
+	Matuc mat;
+	int jpeg_level = min(level, 3);
+	if (is_jpeg(bytes) && decode_jpeg(bytes, mat, 1 << jpeg_level))
+		level -= jpeg_level;
+	else
+		mat = decode_img_uc(bytes, fname);
+	REP(i, level)
+		mat = half_size(mat);
+	return mat;
+}
+
+vector<unsigned char> read_file_bytes(const char* fname) {
+	ifstream fin(fname, ios::binary);
+	if (! fin.good())
+		error_exit(ssprintf("Cannot open \"%s\"!", fname));
+	return vector<unsigned char>(
+			istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+}
+
+Matuc decode_img_uc(const vector<unsigned char>& bytes, const char* fname) {
+	Matuc mat;
+	if (is_jpeg(bytes) && decode_jpeg(bytes, mat))
+		return mat;
+	if (is_png(bytes))
+		return decode_png(bytes);
+	// other formats are read by CImg from the file
 	CImg<unsigned char> img(fname);
 	m_assert(img.spectrum() == 3 || img.spectrum() == 1);
-	Mat32f mat(img.height(), img.width(), 3);
+	mat = Matuc(img.height(), img.width(), 3);
+	int npixel = mat.pixels();
+	// CImg stores channels in separate planes
+	const unsigned char* src = img.data();
+	unsigned char* dst = mat.ptr();
 	if (img.spectrum() == 3) {
-		REP(i, mat.rows())
-			REP(j, mat.cols()) {
-				mat.at(i, j, 0) = (float)img(j, i, 0) / 255.0;
-				mat.at(i, j, 1) = (float)img(j, i, 1) / 255.0;
-				mat.at(i, j, 2) = (float)img(j, i, 2) / 255.0;
-			}
+		const unsigned char *r = src, *g = src + npixel, *b = src + 2 * npixel;
+		REP(i, npixel) {
+			dst[0] = r[i], dst[1] = g[i], dst[2] = b[i];
+			dst += 3;
+		}
 	} else {
-		REP(i, mat.rows())
-			REP(j, mat.cols()) {
-				mat.at(i, j, 0) = mat.at(i, j, 1) = mat.at(i, j, 2) = img(j, i);
-			}
+		REP(i, npixel) {
+			dst[0] = dst[1] = dst[2] = src[i];
+			dst += 3;
+		}
 	}
 	m_assert(mat.rows() > 1 && mat.cols() > 1);
 	return mat;
 }
 
-// TODO a hack for the moment
-Matuc read_img_uc(const char* fname) {
-	return cvt_f2uc(read_img(fname));
-}
-
 
 void write_rgb(const char* fname, const Mat32f& mat) {
 	m_assert(mat.channels() == 3);
-	if (endswith(fname, ".png")) {
-		write_png(fname, mat);
+	if (StripWriter::supported(fname)) {
+		StripWriter::create(fname, mat.width(), mat.height())->write(mat);
 		return;
 	}
 	CImg<unsigned char> img(mat.cols(), mat.rows(), 1, 3);
@@ -188,18 +188,18 @@ void fill(Mat32f& mat, const Color& c) {
 	}
 }
 
-Mat32f crop(const Mat32f& mat) {
-	int w = mat.width(), h = mat.height();
+void largest_rectangle(int w, int h,
+		const std::function<void(int, std::vector<char>&)>& fill_row,
+		Coor& min, Coor& max) {
 	vector<int> height(w, 0),
 		left(w), right(w);
+	vector<char> valid(w);
 	int maxarea = 0;
-	int ll = 0, rr = 0, hh = 0, nl = 0;
+	int ll = 0, rr = -1, hh = 0, nl = 0;
 	REP(line, h) {
-		REP(k, w) {
-			const float* p = mat.ptr(line, k);
-			float m = max(max(p[0], p[1]), p[2]);
-			height[k] = m < 0 ? 0 : height[k] + 1;	// find Color::NO
-		}
+		fill_row(line, valid);
+		REP(k, w)
+			height[k] = valid[k] ? height[k] + 1 : 0;
 
 		REP(k, w) {
 			left[k] = k;
@@ -215,11 +215,24 @@ Mat32f crop(const Mat32f& mat) {
 			if (update_max(maxarea, (right[k] - left[k] + 1) * height[k]))
 				ll = left[k], rr = right[k], hh = height[k], nl = line;
 	}
-	Mat32f ret(hh, rr - ll + 1, 3);
-	int offsetx = ll, offsety = nl - hh + 1;
+	min = Coor(ll, nl - hh + 1);
+	max = Coor(rr + 1, nl + 1);
+}
+
+Mat32f crop(const Mat32f& mat) {
+	Coor min, max;
+	largest_rectangle(mat.width(), mat.height(),
+			[&](int line, vector<char>& valid) {
+				REP(k, mat.width()) {
+					const float* p = mat.ptr(line, k);
+					float m = std::max(std::max(p[0], p[1]), p[2]);
+					valid[k] = m >= 0;	// find Color::NO
+				}
+			}, min, max);
+	Mat32f ret(max.y - min.y, max.x - min.x, 3);
 	REP(i, ret.height()) {
 		float* dst = ret.ptr(i, 0);
-		const float* src = mat.ptr(i + offsety, offsetx);
+		const float* src = mat.ptr(i + min.y, min.x);
 		memcpy(dst, src, 3 * ret.width() * sizeof(float));
 	}
 	return ret;
@@ -239,6 +252,20 @@ Mat32f rgb2grey(const Mat32f& mat) {
 	return ret;
 }
 
+Mat32f rgb2grey(const Matuc& mat) {
+	m_assert(mat.channels() == 3);
+	Mat32f ret(mat.height(), mat.width(), 1);
+	const unsigned char* src = mat.ptr();
+	float* dst = ret.ptr();
+	int n = mat.pixels();
+	const float factor = 1.f / (3 * 255);
+	for (int i = 0; i < n; ++i) {
+		dst[i] = (src[0] + src[1] + src[2]) * factor;
+		src += 3;
+	}
+	return ret;
+}
+
 Matrix getPerspectiveTransform(const std::vector<Vec2D>& p1, const std::vector<Vec2D>& p2) {
 	using namespace Eigen;
 	int n = p1.size();
@@ -316,6 +343,23 @@ void resize<float>(const Mat32f &src, Mat32f &dst) {
 	return resize_bilinear(src, dst);
 }
 
+Matuc half_size(const Matuc& mat) {
+	int w = mat.width(), h = mat.height(), ch = mat.channels();
+	Matuc ret((h + 1) / 2, (w + 1) / 2, ch);
+#pragma omp parallel for schedule(static)
+	REP(i, ret.height()) {
+		const unsigned char *r0 = mat.ptr(2 * i),
+											*r1 = mat.ptr(min(2 * i + 1, h - 1));
+		unsigned char* dst = ret.ptr(i);
+		REP(j, ret.width()) {
+			int j0 = 2 * j * ch, j1 = min(2 * j + 1, w - 1) * ch;
+			REP(c, ch)
+				*(dst++) = (r0[j0 + c] + r0[j1 + c] + r1[j0 + c] + r1[j1 + c] + 2) / 4;
+		}
+	}
+	return ret;
+}
+
 Matuc cvt_f2uc(const Mat32f& mat) {
 	m_assert(mat.channels() == 3);
 	Matuc ret(mat.rows(), mat.cols(), 3);
@@ -327,4 +371,15 @@ Matuc cvt_f2uc(const Mat32f& mat) {
 	return ret;
 }
 
+Mat32f cvt_uc2f(const Matuc& mat) {
+	Mat32f ret(mat.rows(), mat.cols(), mat.channels());
+	auto ps = mat.ptr();
+	auto pt = ret.ptr();
+	int n = mat.pixels() * mat.channels();
+	const float factor = 1.f / 255;
+	REP(i, n)
+		*(pt++) = *(ps++) * factor;
+	return ret;
+}
+
 }
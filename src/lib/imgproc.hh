@@ -4,6 +4,8 @@
 
 #pragma once
 #include <list>
+#include <vector>
+#include <functional>
 #include "mat.h"
 #include "color.hh"
 
@@ -12,6 +14,18 @@ class Matrix;
 namespace pano {
 Mat32f read_img(const char* fname);
 Matuc read_img_uc(const char* fname);
+// read an image downscaled by 2^level: up to 1/8 while decoding a JPEG,
+// and by half_size for the rest
+Matuc read_img_uc(const char* fname, int level);
+std::vector<unsigned char> read_file_bytes(const char* fname);
+// decode the content of an image file.
+// fname is read again if the format can't be decoded from memory
+Matuc decode_img_uc(const std::vector<unsigned char>& bytes, const char* fname);
+// read a single-channel grey image in [0,1], for feature detection.
+// a JPEG is downscaled by 1/2, 1/4 or 1/8 while decoding,
+// as long as its (width + height) stays no less than 2 * min_size.
+// orig_w, orig_h: shape of the full image
+Mat32f read_img_grey(const char* fname, int min_size, int& orig_w, int& orig_h);
 void write_rgb(const char* fname, const Mat32f& mat);
 inline void write_rgb(const std::string s, const Mat32f& mat) { write_rgb(s.c_str(), mat); }
 
@@ -25,9 +39,18 @@ Color interpolate(const Mat32f& mat, float r, float c);
 // return value still in [0,1]
 Color interpolate(const Matuc& mat, float r, float c);
 
+// crop to the largest rectangle without Color::NO
 Mat32f crop(const Mat32f& mat);
 
+// find the largest axis-aligned rectangle [min, max) of valid cells in a w x h grid.
+// fill_row(i, valid) marks the valid cells of row i
+void largest_rectangle(int w, int h,
+		const std::function<void(int, std::vector<char>&)>& fill_row,
+		Coor& min, Coor& max);
+
 Mat32f rgb2grey(const Mat32f& mat);
+// return a single channel image in [0,1]
+Mat32f rgb2grey(const Matuc& mat);
 
 // get transform from p2 to p1
 Matrix getPerspectiveTransform(const std::vector<Vec2D>& p1, const std::vector<Vec2D>& p2);
@@ -38,5 +61,9 @@ void fill(Mat32f& mat, const Color& c);
 template <typename T>
 void resize(const Mat<T> &src, Mat<T> &dst);
 
+// downscale by 2, each pixel being the average of a 2x2 block
+Matuc half_size(const Matuc& mat);
+
 Matuc cvt_f2uc(const Mat32f& mat);
+Mat32f cvt_uc2f(const Matuc& mat);
 }
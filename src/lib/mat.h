@@ -7,7 +7,7 @@
 template <typename T>
 class Mat {
     public:
-				Mat(){}
+				Mat(): m_rows(0), m_cols(0), m_channels(0) {}
 				Mat(int rows, int cols, int channels):
 					m_rows(rows), m_cols(cols), m_channels(channels),
 					m_data{new T[rows * cols * channels], std::default_delete<T[]>() }
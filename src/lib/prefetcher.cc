@@ -0,0 +1,78 @@
+//File: prefetcher.cc
+
+#include "prefetcher.hh"
+#include "lib/debugutils.hh"
+#include "lib/utils.hh"
+using namespace std;
+
+namespace pano {
+
+Prefetcher::Prefetcher(int n, loader_t loader, size_t budget, int nr_thread):
+	n(n), loader(loader), budget(budget),
+	state(n, Pending), bytes(n, 0) {
+	if (budget == 0) return;
+	REP(i, min(nr_thread, n))
+		workers.emplace_back(&Prefetcher::work, this);
+}
+
+Prefetcher::~Prefetcher() {
+	{
+		lock_guard<mutex> lk(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	for (auto& t : workers) t.join();
+}
+
+int Prefetcher::next_pending() {
+	while (next < n && state[next] != Pending) next ++;
+	return next < n ? next : -1;
+}
+
+void Prefetcher::work() {
+	unique_lock<mutex> lk(mtx);
+	while (true) {
+		cv.wait(lk, [&]() {
+			return stop || next_pending() == -1 || in_memory < budget;
+		});
+		int k = next_pending();
+		if (stop || k == -1) return;
+		state[k] = Loading;
+		lk.unlock();
+		size_t sz = loader(k);
+		lk.lock();
+		bytes[k] = sz;
+		in_memory += sz;
+		state[k] = Ready;
+		cv.notify_all();
+	}
+}
+
+void Prefetcher::wait(int k) {
+	m_assert(k >= 0 && k < n);
+	unique_lock<mutex> lk(mtx);
+	if (state[k] == Pending) {
+		// not scheduled yet (e.g. over budget): load it here instead of waiting
+		state[k] = Loading;
+		lk.unlock();
+		size_t sz = loader(k);
+		lk.lock();
+		bytes[k] = sz;
+		in_memory += sz;
+		state[k] = Ready;
+		return;
+	}
+	cv.wait(lk, [&]() { return state[k] != Loading; });
+}
+
+void Prefetcher::done(int k) {
+	{
+		lock_guard<mutex> lk(mtx);
+		m_assert(state[k] == Ready);
+		state[k] = Done;
+		in_memory -= bytes[k];
+	}
+	cv.notify_all();
+}
+
+}
@@ -0,0 +1,59 @@
+//File: prefetcher.hh
+
+#pragma once
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+namespace pano {
+
+// Run an expensive loader (e.g. disk read and decode) for items [0, n)
+// in background threads, ahead of the threads that consume them.
+// Items are loaded in increasing order, while the size of loaded but
+// unconsumed items stays under a memory budget.
+// Consumers call wait(k) before using item k, and done(k) after releasing it.
+// With zero budget, no background thread is used and wait(k) loads item k.
+class Prefetcher {
+	public:
+		// load item k and return its size in bytes
+		typedef std::function<size_t(int)> loader_t;
+
+		Prefetcher(int n, loader_t loader, size_t budget, int nr_thread);
+
+		~Prefetcher();
+
+		Prefetcher(const Prefetcher&) = delete;
+		Prefetcher& operator = (const Prefetcher&) = delete;
+
+		// block until item k is loaded. load it in the caller if not scheduled yet
+		void wait(int k);
+
+		// item k is released by the consumer
+		void done(int k);
+
+	private:
+		enum State { Pending, Loading, Ready, Done };
+
+		int n;
+		loader_t loader;
+		size_t budget;
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::vector<State> state;
+		std::vector<size_t> bytes;
+		size_t in_memory = 0;	// bytes of loaded items not consumed yet
+		int next = 0;					// next item to load in background
+		bool stop = false;
+
+		std::vector<std::thread> workers;
+
+		void work();
+
+		// find the next pending item, -1 if none. requires the lock
+		int next_pending();
+};
+
+}
@@ -0,0 +1,236 @@
+//File: sampler.cc
+
+#include "sampler.hh"
+
+#include <cmath>
+#include <climits>
+#include <algorithm>
+#include "lib/utils.hh"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+namespace pano {
+
+namespace {
+
+// Color::NO in the source
+inline bool is_no(const float* p) { return *p < 0; }
+inline bool is_no(const unsigned char*) { return false; }
+
+// raw values of the source are divided by this
+inline float value_scale(const float*) { return 1; }
+inline float value_scale(const unsigned char*) { return 255; }
+
+inline void write_no(float* out) { out[0] = out[1] = out[2] = -1; }
+
+// the same as interpolate()
+template <typename T>
+bool bilinear(const Mat<T>& mat, float r, float c, float* out) {
+	// also rejects NaN
+	if (!(r >= 0 && c >= 0 && r < mat.rows() - 1 && c < mat.cols() - 1))
+		return false;
+	int fr = floor(r), fc = floor(c);
+	r -= fr, c -= fc;
+	const T *p00 = mat.ptr(fr, fc), *p10 = p00 + mat.cols() * 3,
+				*p11 = p10 + 3, *p01 = p00 + 3;
+	if (is_no(p00) || is_no(p10) || is_no(p11) || is_no(p01))
+		return false;
+	float w00 = (1 - r) * (1 - c), w10 = r * (1 - c),
+				w11 = r * c, w01 = (1 - r) * c;
+	float scale = value_scale(p00);
+	REP(ch, 3) {
+		float v = p00[ch] * w00;
+		v += p10[ch] * w10;
+		v += p11[ch] * w11;
+		v += p01[ch] * w01;
+		out[ch] = v / scale;
+	}
+	return true;
+}
+
+// Catmull-Rom weights of the 4 neighbors, at t in [0, 1) after the second one
+inline void cubic_weights(float t, float* w) {
+	w[0] = ((-0.5f * t + 1) * t - 0.5f) * t;
+	w[1] = (1.5f * t - 2.5f) * t * t + 1;
+	w[2] = ((-1.5f * t + 2) * t + 0.5f) * t;
+	w[3] = (0.5f * t - 0.5f) * t * t;
+}
+
+template <typename T>
+bool bicubic(const Mat<T>& mat, float r, float c, float* out) {
+	if (!(r >= 1 && c >= 1 && r < mat.rows() - 2 && c < mat.cols() - 2))
+		return bilinear(mat, r, c, out);
+	int fr = floor(r), fc = floor(c);
+	float wr[4], wc[4];
+	cubic_weights(r - fr, wr);
+	cubic_weights(c - fc, wc);
+	float v[3] = {0, 0, 0};
+	REP(i, 4) {
+		const T* p = mat.ptr(fr - 1 + i, fc - 1);
+		float h[3] = {0, 0, 0};
+		REP(j, 4) {
+			if (is_no(p))
+				return bilinear(mat, r, c, out);
+			REP(ch, 3) h[ch] += p[ch] * wc[j];
+			p += 3;
+		}
+		REP(ch, 3) v[ch] += h[ch] * wr[i];
+	}
+	float scale = value_scale(mat.ptr());
+	REP(ch, 3) out[ch] = min(max(v[ch] / scale, 0.f), 1.f);
+	return true;
+}
+
+#ifdef __AVX2__
+// 8 points located on the source
+struct Lanes {
+	__m256 dr, dc;		// fraction part of the coordinates
+	__m256i off;			// offset of the top-left neighbor, in values. 0 for invalid points
+	int mask;					// of the valid points
+};
+
+inline Lanes locate8(const float* rows, const float* cols, int h, int w) {
+	__m256 r = _mm256_loadu_ps(rows), c = _mm256_loadu_ps(cols),
+				 zero = _mm256_setzero_ps();
+	// ordered comparisons are false on NaN
+	__m256 ok = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(r, zero, _CMP_GE_OQ), _mm256_cmp_ps(c, zero, _CMP_GE_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(r, _mm256_set1_ps(h - 1), _CMP_LT_OQ),
+				_mm256_cmp_ps(c, _mm256_set1_ps(w - 1), _CMP_LT_OQ)));
+	r = _mm256_and_ps(r, ok), c = _mm256_and_ps(c, ok);
+	__m256 fr = _mm256_floor_ps(r), fc = _mm256_floor_ps(c);
+	Lanes ret;
+	ret.dr = _mm256_sub_ps(r, fr);
+	ret.dc = _mm256_sub_ps(c, fc);
+	__m256i idx = _mm256_add_epi32(
+			_mm256_mullo_epi32(_mm256_cvtps_epi32(fr), _mm256_set1_epi32(w)),
+			_mm256_cvtps_epi32(fc));
+	ret.off = _mm256_mullo_epi32(idx, _mm256_set1_epi32(3));
+	ret.mask = _mm256_movemask_ps(ok);
+	return ret;
+}
+
+// v[ch] = (a[ch] * w00 + b[ch] * w10 + c[ch] * w11 + d[ch] * w01) / scale, in the order of bilinear()
+inline void blend8(const Lanes& l, const __m256 (&a)[3], const __m256 (&b)[3],
+		const __m256 (&c)[3], const __m256 (&d)[3], float scale, float* out, int mask) {
+	__m256 one = _mm256_set1_ps(1),
+				 rdr = _mm256_sub_ps(one, l.dr), rdc = _mm256_sub_ps(one, l.dc),
+				 w00 = _mm256_mul_ps(rdr, rdc), w10 = _mm256_mul_ps(l.dr, rdc),
+				 w11 = _mm256_mul_ps(l.dr, l.dc), w01 = _mm256_mul_ps(rdr, l.dc),
+				 vscale = _mm256_set1_ps(scale);
+	alignas(32) float res[3][8];
+	REP(ch, 3) {
+		__m256 v = _mm256_mul_ps(a[ch], w00);
+		v = _mm256_add_ps(v, _mm256_mul_ps(b[ch], w10));
+		v = _mm256_add_ps(v, _mm256_mul_ps(c[ch], w11));
+		v = _mm256_add_ps(v, _mm256_mul_ps(d[ch], w01));
+		_mm256_store_ps(res[ch], _mm256_div_ps(v, vscale));
+	}
+	REP(k, 8) {
+		if (mask >> k & 1)
+			REP(ch, 3) out[ch] = res[ch][k];
+		else
+			write_no(out);
+		out += 3;
+	}
+}
+
+// return the mask of valid points
+int bilinear8(const Mat32f& mat, const float* rows, const float* cols, float* out) {
+	int w = mat.cols();
+	Lanes l = locate8(rows, cols, mat.rows(), w);
+	if (! l.mask) {
+		REP(k, 8) write_no(out + k * 3);
+		return 0;
+	}
+	const float* base = mat.ptr();
+	__m256i offs[4] = {l.off,
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(w * 3)),
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(w * 3 + 3)),
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(3))};
+	__m256 px[4][3];
+	__m256 zero = _mm256_setzero_ps();
+	int mask = l.mask;
+	REP(i, 4) {
+		REP(ch, 3)
+			px[i][ch] = _mm256_i32gather_ps(base,
+					_mm256_add_epi32(offs[i], _mm256_set1_epi32(ch)), 4);
+		mask &= _mm256_movemask_ps(_mm256_cmp_ps(px[i][0], zero, _CMP_GE_OQ));
+	}
+	blend8(l, px[0], px[1], px[2], px[3], 1, out, mask);
+	return mask;
+}
+
+int bilinear8(const Matuc& mat, const float* rows, const float* cols, float* out) {
+	int w = mat.cols();
+	Lanes l = locate8(rows, cols, mat.rows(), w);
+	if (! l.mask) {
+		REP(k, 8) write_no(out + k * 3);
+		return 0;
+	}
+	// gather 4 bytes of each pixel: rgb and the next byte.
+	// the bottom-right one is gathered from the byte before it, to not read beyond the image
+	const int* base = reinterpret_cast<const int*>(mat.ptr());
+	__m256i offs[4] = {l.off,
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(w * 3)),
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(w * 3 + 2)),
+		_mm256_add_epi32(l.off, _mm256_set1_epi32(3))};
+	int first_byte[4] = {0, 0, 1, 0};
+	__m256i byte_mask = _mm256_set1_epi32(0xff);
+	__m256 px[4][3];
+	REP(i, 4) {
+		__m256i v = _mm256_i32gather_epi32(base, offs[i], 1);
+		REP(ch, 3)
+			px[i][ch] = _mm256_cvtepi32_ps(_mm256_and_si256(
+						_mm256_srlv_epi32(v, _mm256_set1_epi32((first_byte[i] + ch) * 8)), byte_mask));
+	}
+	blend8(l, px[0], px[1], px[2], px[3], 255, out, l.mask);
+	return l.mask;
+}
+#endif
+
+template <typename T>
+int sample_row_impl(const Mat<T>& mat, const float* rows, const float* cols, int n,
+		float* out, unsigned char* valid, Interpolation mode) {
+	m_assert(mat.channels() == 3);
+	int k = 0, nr_valid = 0;
+#ifdef __AVX2__
+	// offsets are gathered as 32-bit integers
+	if (mode == Interpolation::Bilinear && (long long)mat.pixels() * 3 < INT_MAX - 8)
+		for (; k + 8 <= n; k += 8) {
+			int mask = bilinear8(mat, rows + k, cols + k, out + k * 3);
+			REP(i, 8) {
+				valid[k + i] = mask >> i & 1;
+				nr_valid += valid[k + i];
+			}
+		}
+#endif
+	for (; k < n; k ++) {
+		bool ok = mode == Interpolation::Bilinear ?
+			bilinear(mat, rows[k], cols[k], out + k * 3) :
+			bicubic(mat, rows[k], cols[k], out + k * 3);
+		if (! ok)
+			write_no(out + k * 3);
+		valid[k] = ok;
+		nr_valid += ok;
+	}
+	return nr_valid;
+}
+
+}
+
+int sample_row(const Mat32f& mat, const float* rows, const float* cols, int n,
+		float* out, unsigned char* valid, Interpolation mode) {
+	return sample_row_impl(mat, rows, cols, n, out, valid, mode);
+}
+
+int sample_row(const Matuc& mat, const float* rows, const float* cols, int n,
+		float* out, unsigned char* valid, Interpolation mode) {
+	return sample_row_impl(mat, rows, cols, n, out, valid, mode);
+}
+
+}
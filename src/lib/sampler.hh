@@ -0,0 +1,31 @@
+//File: sampler.hh
+
+#pragma once
+#include "mat.h"
+#include "config.hh"
+
+namespace pano {
+
+enum class Interpolation { Bilinear, Bicubic };
+
+// the one chosen by config BICUBIC
+inline Interpolation config_interpolation() {
+	return config::BICUBIC ? Interpolation::Bicubic : Interpolation::Bilinear;
+}
+
+// Sample an RGB image at n points (rows[k], cols[k]), e.g. the source coordinates
+// of a row of output pixels, into out (3 floats per point) and valid (1 or 0 per point).
+// A point is invalid if it's NaN or out of border, or has a Color::NO neighbor in a Mat32f.
+// Invalid points are written as Color::NO. Return the number of valid points.
+//
+// Bilinear sampling gives the same colors as interpolate(), and gathers 8 points at once with AVX2.
+// Bicubic sampling uses the Catmull-Rom spline on 4x4 neighbors, clamped to [0, 1],
+// and falls back to bilinear on the outermost pixels of the image.
+int sample_row(const Mat32f& mat, const float* rows, const float* cols, int n,
+		float* out, unsigned char* valid, Interpolation mode = Interpolation::Bilinear);
+
+// colors are in [0, 1]
+int sample_row(const Matuc& mat, const float* rows, const float* cols, int n,
+		float* out, unsigned char* valid, Interpolation mode = Interpolation::Bilinear);
+
+}
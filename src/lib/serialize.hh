@@ -0,0 +1,72 @@
+//File: serialize.hh
+
+#pragma once
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// helpers to read/write plain data in native binary layout
+namespace pano {
+
+template <typename T>
+inline void write_pod(std::ostream& os, const T& v) {
+	os.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+inline void read_pod(std::istream& is, T& v) {
+	is.read(reinterpret_cast<char*>(&v), sizeof(T));
+}
+
+template <typename T>
+inline T read_pod(std::istream& is) {
+	T ret;
+	read_pod(is, ret);
+	return ret;
+}
+
+// sizes read beyond these fail the stream instead of allocating, as the data is corrupted
+const unsigned long long MAX_READ_VEC_BYTES = 1ULL << 30;
+const unsigned MAX_READ_STR_SIZE = 1 << 20;
+
+// T has to be trivially copyable
+template <typename T>
+inline void write_vec(std::ostream& os, const std::vector<T>& v) {
+	write_pod(os, (unsigned long long)v.size());
+	if (v.size())
+		os.write(reinterpret_cast<const char*>(v.data()), sizeof(T) * v.size());
+}
+
+template <typename T>
+inline void read_vec(std::istream& is, std::vector<T>& v) {
+	auto n = read_pod<unsigned long long>(is);
+	if (!is.good() || n > MAX_READ_VEC_BYTES / sizeof(T)) {
+		is.setstate(std::ios::failbit);
+		v.clear();
+		return;
+	}
+	v.resize(n);
+	if (v.size())
+		is.read(reinterpret_cast<char*>(v.data()), sizeof(T) * v.size());
+}
+
+inline void write_str(std::ostream& os, const std::string& s) {
+	write_pod(os, (unsigned)s.size());
+	os.write(s.data(), s.size());
+}
+
+inline std::string read_str(std::istream& is) {
+	std::string ret;
+	auto n = read_pod<unsigned>(is);
+	if (!is.good() || n > MAX_READ_STR_SIZE) {
+		is.setstate(std::ios::failbit);
+		return ret;
+	}
+	ret.resize(n);
+	if (ret.size())
+		is.read(&ret[0], ret.size());
+	return ret;
+}
+
+}
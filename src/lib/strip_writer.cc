@@ -0,0 +1,585 @@
+//File: strip_writer.cc
+
+#include "strip_writer.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <omp.h>
+#include <zlib.h>
+extern "C" {
+#include <jpeglib.h>
+}
+
+#include "lib/config.hh"
+#include "lib/debugutils.hh"
+#include "lib/utils.hh"
+using namespace std;
+using namespace pano;
+
+namespace {
+
+const int JPEG_QUALITY = 100;
+// rows of MCU in each independently encoded JPEG strip
+const int JPEG_STRIP_MCU_ROWS = 8;
+// input bytes of each independently deflated PNG block
+const int PNG_BLOCK_SIZE = 1 << 17;
+const int DEFLATE_WINDOW = 1 << 15;
+const int DEEPZOOM_JPEG_QUALITY = 90;
+const int DEEPZOOM_DEFAULT_TILE_SIZE = 256;
+
+bool is_jpeg_name(const char* fname) {
+	return endswith(fname, ".jpg") || endswith(fname, ".jpeg")
+		|| endswith(fname, ".JPG") || endswith(fname, ".JPEG");
+}
+
+bool is_png_name(const char* fname) {
+	return endswith(fname, ".png") || endswith(fname, ".PNG");
+}
+
+bool is_dzi_name(const char* fname) {
+	return endswith(fname, ".dzi");
+}
+
+FILE* open_or_die(const char* fname) {
+	FILE* fout = fopen(fname, "wb");
+	if (! fout)
+		error_exit(ssprintf("Cannot open \"%s\" to write!", fname));
+	return fout;
+}
+
+void write_or_die(FILE* fout, const void* data, size_t len) {
+	if (len && fwrite(data, 1, len, fout) != len)
+		error_exit("Failed to write image!");
+}
+
+void put_u16(unsigned char* p, unsigned v) { p[0] = v >> 8, p[1] = v; }
+
+void put_u32(unsigned char* p, unsigned v) {
+	p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+	char msg[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message)(cinfo, msg);
+	error_exit(ssprintf("libjpeg error: %s", msg));
+}
+
+// create a compressor of RGB input
+void init_jpeg_compress(jpeg_compress_struct& cinfo, jpeg_error_mgr& jerr,
+		int w, int h, int quality) {
+	cinfo.err = jpeg_std_error(&jerr);
+	jerr.error_exit = jpeg_error_exit;
+	jpeg_create_compress(&cinfo);
+	cinfo.image_width = w;
+	cinfo.image_height = h;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+}
+
+// Strips are encoded as standalone JPEGs with identical tables.
+// The output takes the header of the first one with the full height,
+// and joins the entropy-coded data of all strips with RST markers,
+// using one restart interval per strip.
+class JpegStripWriter : public StripWriter {
+	public:
+		JpegStripWriter(const char* fname, int w, int h):
+			StripWriter(w, h), fout(open_or_die(fname)) {
+			jpeg_compress_struct cinfo;
+			jpeg_error_mgr jerr;
+			setup(cinfo, jerr, w, h);
+			int mcu_w = 0, mcu_h = 0;
+			REP(i, cinfo.num_components) {
+				update_max(mcu_w, cinfo.comp_info[i].h_samp_factor * DCTSIZE);
+				update_max(mcu_h, cinfo.comp_info[i].v_samp_factor * DCTSIZE);
+			}
+			jpeg_destroy_compress(&cinfo);
+
+			int mcus_per_row = (w + mcu_w - 1) / mcu_w;
+			if (mcus_per_row > 65535)
+				error_exit("Image too wide to be written as JPEG!");
+			// the height in the header is only written by write_header, and never checked by libjpeg
+			if (h > JPEG_MAX_DIMENSION)
+				error_exit(ssprintf("Image too tall to be written as JPEG! Height %d > %d",
+							h, (int)JPEG_MAX_DIMENSION));
+			// restart interval is 16-bit
+			int mcu_rows = max(1, min(JPEG_STRIP_MCU_ROWS, 65535 / mcus_per_row));
+			strip_rows = mcu_rows * mcu_h;
+			restart_interval = mcu_rows * mcus_per_row;
+			set_batch_rows(strip_rows * omp_get_max_threads());
+		}
+
+		~JpegStripWriter() { if (fout) fclose(fout); }
+
+	protected:
+		void write_batch(const unsigned char* rows, int nr_rows) override {
+			int nr_strip = (nr_rows + strip_rows - 1) / strip_rows;
+			vector<vector<unsigned char>> encoded(nr_strip);
+#pragma omp parallel for schedule(dynamic)
+			REP(k, nr_strip) {
+				int start = k * strip_rows, len = min(strip_rows, nr_rows - start);
+				encoded[k] = encode_strip(rows + (size_t)start * w * 3, len);
+			}
+			REP(k, nr_strip) {
+				auto& data = encoded[k];
+				size_t sos_end = find_scan_start(data);
+				if (nr_strip_written == 0)
+					write_header(data, sos_end);
+				else {
+					unsigned char rst[2] = {0xFF, (unsigned char)(0xD0 + (nr_strip_written - 1) % 8)};
+					write_or_die(fout, rst, 2);
+				}
+				// entropy-coded data, without EOI
+				write_or_die(fout, data.data() + sos_end, data.size() - 2 - sos_end);
+				nr_strip_written ++;
+			}
+		}
+
+		void finish() override {
+			unsigned char eoi[2] = {0xFF, 0xD9};
+			write_or_die(fout, eoi, 2);
+			fclose(fout);
+			fout = nullptr;
+		}
+
+	private:
+		FILE* fout;
+		int strip_rows, restart_interval;
+		int nr_strip_written = 0;
+
+		static void setup(jpeg_compress_struct& cinfo, jpeg_error_mgr& jerr, int w, int h) {
+			init_jpeg_compress(cinfo, jerr, w, h, JPEG_QUALITY);
+			// standard huffman tables, so that all strips share them
+			cinfo.optimize_coding = FALSE;
+		}
+
+		vector<unsigned char> encode_strip(const unsigned char* rows, int nr_rows) const {
+			jpeg_compress_struct cinfo;
+			jpeg_error_mgr jerr;
+			setup(cinfo, jerr, w, nr_rows);
+			unsigned char* buf = nullptr;
+			unsigned long size = 0;
+			jpeg_mem_dest(&cinfo, &buf, &size);
+			jpeg_start_compress(&cinfo, TRUE);
+			REP(i, nr_rows) {
+				JSAMPROW ptr = const_cast<unsigned char*>(rows + (size_t)i * w * 3);
+				jpeg_write_scanlines(&cinfo, &ptr, 1);
+			}
+			jpeg_finish_compress(&cinfo);
+			jpeg_destroy_compress(&cinfo);
+			vector<unsigned char> ret(buf, buf + size);
+			free(buf);
+			return ret;
+		}
+
+		// return the position after the SOS segment
+		static size_t find_scan_start(const vector<unsigned char>& data) {
+			size_t pos = 2;		// after SOI
+			while (pos + 4 <= data.size()) {
+				m_assert(data[pos] == 0xFF);
+				unsigned char marker = data[pos + 1];
+				size_t len = (data[pos + 2] << 8) | data[pos + 3];
+				pos += 2 + len;
+				if (marker == 0xDA) return pos;
+			}
+			error_exit("Cannot find scan in the encoded JPEG!");
+		}
+
+		// header of the first strip, with full image height and a restart interval
+		void write_header(vector<unsigned char>& data, size_t sos_end) {
+			size_t pos = 2, sos_start = 0;
+			while (pos < sos_end) {
+				unsigned char marker = data[pos + 1];
+				size_t len = (data[pos + 2] << 8) | data[pos + 3];
+				if (marker == 0xC0)		// SOF0: length, precision, height, width
+					put_u16(&data[pos + 5], h);
+				if (marker == 0xDA) sos_start = pos;
+				pos += 2 + len;
+			}
+			write_or_die(fout, data.data(), sos_start);
+			unsigned char dri[6] = {0xFF, 0xDD, 0, 4};
+			put_u16(dri + 4, restart_interval);
+			write_or_die(fout, dri, 6);
+			write_or_die(fout, data.data() + sos_start, sos_end - sos_start);
+		}
+};
+
+// PNG with one zlib stream, made of blocks deflated in parallel.
+// Each block is primed with the last 32KB before it, and ends on a
+// byte boundary with a sync flush, so that they can be concatenated.
+// Each row uses the filter with minimum sum of absolute values, as lodepng does.
+class PngStripWriter : public StripWriter {
+	public:
+		PngStripWriter(const char* fname, int w, int h):
+			StripWriter(w, h), fout(open_or_die(fname)),
+			prev(w * 3, 0) {
+			const unsigned char sig[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+			write_or_die(fout, sig, 8);
+			unsigned char ihdr[13];
+			put_u32(ihdr, w);
+			put_u32(ihdr + 4, h);
+			ihdr[8] = 8;		// bit depth
+			ihdr[9] = 2;		// RGB
+			ihdr[10] = ihdr[11] = ihdr[12] = 0;	// deflate, adaptive filter, no interlace
+			write_chunk("IHDR", ihdr, 13);
+			unsigned char zheader[2] = {0x78, 0x9C};
+			write_chunk("IDAT", zheader, 2);
+
+			block_rows = max(1, PNG_BLOCK_SIZE / (w * 3 + 1));
+			set_batch_rows(block_rows * omp_get_max_threads());
+		}
+
+		~PngStripWriter() { if (fout) fclose(fout); }
+
+	protected:
+		void write_batch(const unsigned char* rows, int nr_rows) override {
+			size_t row_len = w * 3 + 1;
+			vector<unsigned char> filtered(row_len * nr_rows);
+#pragma omp parallel for schedule(static)
+			REP(i, nr_rows) {
+				const unsigned char* up = i ? rows + (size_t)(i - 1) * w * 3 : prev.data();
+				filter_row(rows + (size_t)i * w * 3, up, filtered.data() + i * row_len);
+			}
+			memcpy(prev.data(), rows + (size_t)(nr_rows - 1) * w * 3, w * 3);
+
+			// the last batch is written when all rows are written
+			bool last_batch = written == h;
+			int nr_block = (nr_rows + block_rows - 1) / block_rows;
+			size_t block_len = block_rows * row_len;
+			vector<vector<unsigned char>> compressed(nr_block);
+#pragma omp parallel for schedule(dynamic)
+			REP(k, nr_block) {
+				size_t start = k * block_len,
+							 len = min(block_len, filtered.size() - start);
+				const unsigned char* dict;
+				size_t dict_len;
+				if (k) {
+					dict_len = min(start, (size_t)DEFLATE_WINDOW);
+					dict = filtered.data() + start - dict_len;
+				} else {
+					dict_len = window.size();
+					dict = window.data();
+				}
+				compressed[k] = deflate_block(filtered.data() + start, len,
+						dict, dict_len, last_batch && k == nr_block - 1);
+			}
+
+			REP(k, nr_block) {
+				size_t start = k * block_len,
+							 len = min(block_len, filtered.size() - start);
+				adler = adler32_combine(adler, adler32(1, filtered.data() + start, len), len);
+				write_chunk("IDAT", compressed[k].data(), compressed[k].size());
+			}
+			// dictionary of the next batch
+			size_t keep = min(filtered.size(), (size_t)DEFLATE_WINDOW);
+			window.assign(filtered.end() - keep, filtered.end());
+		}
+
+		void finish() override {
+			unsigned char buf[4];
+			put_u32(buf, adler);
+			write_chunk("IDAT", buf, 4);
+			write_chunk("IEND", nullptr, 0);
+			fclose(fout);
+			fout = nullptr;
+		}
+
+	private:
+		FILE* fout;
+		int block_rows;
+		std::vector<unsigned char> prev;		// last row of the previous batch
+		std::vector<unsigned char> window;	// last filtered bytes of the previous batch
+		uLong adler = 1;
+
+		static unsigned char predict(int type, int a, int b, int c) {
+			switch (type) {
+				case 1: return a;
+				case 2: return b;
+				case 3: return (a + b) / 2;
+				case 4: {
+					int p = a + b - c;
+					int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+					if (pa <= pb && pa <= pc) return a;
+					return pb <= pc ? b : c;
+				}
+				default: return 0;
+			}
+		}
+
+		void filter_row(const unsigned char* row, const unsigned char* up,
+				unsigned char* dst) const {
+			int n = w * 3;
+			vector<unsigned char> now(n + 1);
+			long best_sum = -1;
+			REP(type, 5) {
+				now[0] = type;
+				long sum = 0;
+				REP(i, n) {
+					unsigned char a = i >= 3 ? row[i - 3] : 0;	// left
+					unsigned char b = up[i];	// up
+					unsigned char c = i >= 3 ? up[i - 3] : 0;	// upper left
+					unsigned char v = row[i] - predict(type, a, b, c);
+					now[i + 1] = v;
+					sum += type == 0 ? v : abs((signed char)v);
+				}
+				if (best_sum < 0 || sum < best_sum) {
+					best_sum = sum;
+					memcpy(dst, now.data(), n + 1);
+				}
+			}
+		}
+
+		// raw deflate, ending with a sync flush, or the final block
+		static vector<unsigned char> deflate_block(
+				const unsigned char* data, size_t len,
+				const unsigned char* dict, size_t dict_len, bool last) {
+			z_stream zs;
+			memset(&zs, 0, sizeof(zs));
+			if (deflateInit2(&zs, config::PNG_COMPRESSION_LEVEL, Z_DEFLATED,
+						-15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				error_exit("Failed to initialize zlib!");
+			if (dict_len)
+				deflateSetDictionary(&zs, dict, dict_len);
+			vector<unsigned char> ret(deflateBound(&zs, len) + 16);
+			zs.next_in = const_cast<unsigned char*>(data);
+			zs.avail_in = len;
+			zs.next_out = ret.data();
+			zs.avail_out = ret.size();
+			int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+			while (true) {
+				int err = deflate(&zs, flush);
+				if (err == Z_STREAM_ERROR)
+					error_exit("zlib deflate failed!");
+				if (last ? err == Z_STREAM_END : (zs.avail_in == 0 && zs.avail_out > 0))
+					break;
+				if (zs.avail_out == 0) {
+					size_t done = ret.size();
+					ret.resize(done * 2);
+					zs.next_out = ret.data() + done;
+					zs.avail_out = ret.size() - done;
+				}
+			}
+			ret.resize(ret.size() - zs.avail_out);
+			deflateEnd(&zs);
+			return ret;
+		}
+
+		void write_chunk(const char* type, const unsigned char* data, unsigned len) {
+			unsigned char buf[4];
+			put_u32(buf, len);
+			write_or_die(fout, buf, 4);
+			write_or_die(fout, type, 4);
+			uLong crc = crc32(0, (const Bytef*)type, 4);
+			if (len) {
+				write_or_die(fout, data, len);
+				crc = crc32(crc, data, len);
+			}
+			put_u32(buf, crc);
+			write_or_die(fout, buf, 4);
+		}
+};
+
+// DeepZoom pyramid for web viewers: fname.dzi describes the image,
+// and <name>_files/<level>/<column>_<row>.jpg are the tiles, without overlap.
+// Level k is the image downsampled by 2^(max_level - k), down to 1x1.
+// A band of tile rows is tiled as soon as it is complete, then halved by
+// a 2x2 box filter into the level below, so each level keeps one band at most.
+class DeepZoomWriter : public StripWriter {
+	public:
+		DeepZoomWriter(const char* fname, int w, int h):
+			StripWriter(w, h), dzi_name(fname),
+			tile(config::DEEPZOOM_TILE_SIZE > 0 ?
+					config::DEEPZOOM_TILE_SIZE : DEEPZOOM_DEFAULT_TILE_SIZE) {
+			m_assert(tile % 2 == 0);
+			dir = dzi_name.substr(0, dzi_name.size() - 4) + "_files";
+			if (! make_dir(dir.c_str()))
+				error_exit(ssprintf("Cannot create directory \"%s\"!", dir.c_str()));
+
+			int max_level = 0;
+			while ((1 << max_level) < max(w, h))
+				max_level ++;
+			levels.resize(max_level + 1);
+			int lw = w, lh = h;
+			REPD(k, max_level, 0) {
+				auto& l = levels[k];
+				l.w = lw, l.h = lh;
+				l.buf.resize((size_t)min(tile, lh) * lw * 3);
+				string level_dir = ssprintf("%s/%d", dir.c_str(), k);
+				if (! make_dir(level_dir.c_str()))
+					error_exit(ssprintf("Cannot create directory \"%s\"!", level_dir.c_str()));
+				lw = (lw + 1) / 2, lh = (lh + 1) / 2;
+			}
+			set_batch_rows(tile);
+		}
+
+	protected:
+		void write_batch(const unsigned char* rows, int nr_rows) override {
+			add_rows(levels.size() - 1, rows, nr_rows);
+		}
+
+		void finish() override {
+			for (auto& l : levels)
+				m_assert(l.nr_done == l.h);
+			string xml = ssprintf(
+					"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+					"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+					"Format=\"jpg\" Overlap=\"0\" TileSize=\"%d\">\n"
+					"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+					"</Image>\n", tile, w, h);
+			FILE* fout = open_or_die(dzi_name.c_str());
+			write_or_die(fout, xml.data(), xml.size());
+			fclose(fout);
+		}
+
+	private:
+		struct Level {
+			int w, h;
+			int nr_done = 0;			// rows already tiled
+			int nr_buffered = 0;	// rows in buf
+			vector<unsigned char> buf;	// the incomplete band
+		};
+
+		string dzi_name, dir;
+		int tile;
+		vector<Level> levels;
+
+		// append rows to level k, tile and downsample the bands completed
+		void add_rows(int k, const unsigned char* rows, int nr_rows) {
+			auto& l = levels[k];
+			size_t row_bytes = (size_t)l.w * 3;
+			while (nr_rows) {
+				int band_rows = min(tile, l.h - l.nr_done);
+				int n = min(nr_rows, band_rows - l.nr_buffered);
+				const unsigned char* band;
+				if (l.nr_buffered == 0 && n == band_rows)
+					band = rows;		// a complete band, no need to copy
+				else {
+					memcpy(l.buf.data() + l.nr_buffered * row_bytes, rows, n * row_bytes);
+					band = l.buf.data();
+				}
+				rows += n * row_bytes;
+				nr_rows -= n;
+				l.nr_buffered += n;
+				if (l.nr_buffered < band_rows)
+					continue;
+
+				write_band(k, band, band_rows);
+				l.nr_done += band_rows;
+				l.nr_buffered = 0;
+				if (k) {
+					auto half = downsample(k, band, band_rows);
+					add_rows(k - 1, half.data(), (band_rows + 1) / 2);
+				}
+			}
+		}
+
+		void write_band(int k, const unsigned char* band, int nr_rows) const {
+			auto& l = levels[k];
+			int nr_col = (l.w + tile - 1) / tile, row = l.nr_done / tile;
+#pragma omp parallel for schedule(dynamic)
+			REP(c, nr_col) {
+				int x0 = c * tile;
+				string fname = ssprintf("%s/%d/%d_%d.jpg", dir.c_str(), k, c, row);
+				write_tile(fname.c_str(), band + x0 * 3, l.w * 3,
+						min(tile, l.w - x0), nr_rows);
+			}
+		}
+
+		static void write_tile(const char* fname, const unsigned char* data,
+				size_t stride, int tw, int th) {
+			FILE* fout = open_or_die(fname);
+			jpeg_compress_struct cinfo;
+			jpeg_error_mgr jerr;
+			init_jpeg_compress(cinfo, jerr, tw, th, DEEPZOOM_JPEG_QUALITY);
+			jpeg_stdio_dest(&cinfo, fout);
+			jpeg_start_compress(&cinfo, TRUE);
+			REP(i, th) {
+				JSAMPROW ptr = const_cast<unsigned char*>(data + i * stride);
+				jpeg_write_scanlines(&cinfo, &ptr, 1);
+			}
+			jpeg_finish_compress(&cinfo);
+			jpeg_destroy_compress(&cinfo);
+			fclose(fout);
+		}
+
+		// halve a band of level k to rows of level k - 1
+		vector<unsigned char> downsample(int k, const unsigned char* band, int nr_rows) const {
+			int w0 = levels[k].w, nw = levels[k - 1].w, nh = (nr_rows + 1) / 2;
+			size_t row_bytes = (size_t)w0 * 3;
+			vector<unsigned char> ret((size_t)nh * nw * 3);
+#pragma omp parallel for schedule(static)
+			REP(i, nh) {
+				const unsigned char* r0 = band + 2 * i * row_bytes,
+														*r1 = 2 * i + 1 < nr_rows ? r0 + row_bytes : r0;
+				unsigned char* dst = ret.data() + (size_t)i * nw * 3;
+				REP(j, nw) {
+					int j0 = 2 * j * 3, j1 = min(2 * j + 1, w0 - 1) * 3;
+					REP(c, 3)
+						dst[j * 3 + c] = (r0[j0 + c] + r0[j1 + c] + r1[j0 + c] + r1[j1 + c] + 2) / 4;
+				}
+			}
+			return ret;
+		}
+};
+
+}	// namespace
+
+namespace pano {
+
+unique_ptr<StripWriter> StripWriter::create(
+		const char* fname, int width, int height) {
+	m_assert(width > 0 && height > 0);
+	if (is_jpeg_name(fname))
+		return unique_ptr<StripWriter>(new JpegStripWriter(fname, width, height));
+	if (is_png_name(fname))
+		return unique_ptr<StripWriter>(new PngStripWriter(fname, width, height));
+	if (is_dzi_name(fname))
+		return unique_ptr<StripWriter>(new DeepZoomWriter(fname, width, height));
+	error_exit(ssprintf("Cannot write \"%s\" by strips!", fname));
+}
+
+bool StripWriter::supported(const char* fname) {
+	return is_jpeg_name(fname) || is_png_name(fname) || is_dzi_name(fname);
+}
+
+void StripWriter::set_batch_rows(int rows) {
+	batch_rows = min(rows, h);
+	buf.resize((size_t)batch_rows * w * 3);
+}
+
+void StripWriter::write(const Mat32f& strip) {
+	m_assert(strip.channels() == 3 && strip.width() == w);
+	write(strip.ptr(), strip.height());
+}
+
+void StripWriter::write(const float* rows, int nr_rows) {
+	m_assert(written + nr_rows <= h && batch_rows > 0);
+	while (nr_rows) {
+		int n = min(nr_rows, batch_rows - nr_buffered);
+#pragma omp parallel for schedule(static)
+		REP(r, n) {
+			const float* p = rows + (size_t)r * w * 3;
+			unsigned char* dst = buf.data() + (size_t)(nr_buffered + r) * w * 3;
+			REP(i, w * 3) {
+				// use white background. Color::NO turns to 1
+				float v = p[i] < 0 ? 1 : min(p[i], 1.f);
+				dst[i] = v * 255;
+			}
+		}
+		rows += (size_t)n * w * 3;
+		nr_rows -= n;
+		nr_buffered += n;
+		written += n;
+		if (nr_buffered == batch_rows || written == h) {
+			write_batch(buf.data(), nr_buffered);
+			nr_buffered = 0;
+		}
+	}
+	if (written == h)
+		finish();
+}
+
+}
@@ -0,0 +1,61 @@
+//File: strip_writer.hh
+
+#pragma once
+#include <memory>
+#include <vector>
+#include "mat.h"
+
+namespace pano {
+
+// Encode an RGB image incrementally, by strips of rows from top to bottom,
+// so that the whole image is never held in 8-bit.
+// Color::NO is written as white. The file is complete after the last row.
+// Rows are buffered into batches, which are encoded by all OpenMP threads:
+// JPEG by independent strips joined with restart markers,
+// PNG by independent deflate blocks, as pigz does,
+// DeepZoom (.dzi) by tiles of all zoom levels.
+class StripWriter {
+	public:
+		// choose the encoder by extension: .jpg, .jpeg, .png or .dzi
+		static std::unique_ptr<StripWriter> create(
+				const char* fname, int width, int height);
+
+		static bool supported(const char* fname);
+
+		virtual ~StripWriter() {}
+
+		StripWriter(const StripWriter&) = delete;
+		StripWriter& operator = (const StripWriter&) = delete;
+
+		// append a strip of width columns and 3 channels
+		void write(const Mat32f& strip);
+
+		// append nr_rows contiguous rows
+		void write(const float* rows, int nr_rows);
+
+		int width() const { return w; }
+		int height() const { return h; }
+		int nr_written() const { return written; }
+
+	protected:
+		StripWriter(int w, int h): w(w), h(h) {}
+
+		int w, h;
+		int written = 0;
+
+		// to be called by subclass constructors
+		void set_batch_rows(int rows);
+
+		// encode rows of 8-bit RGB. called in order, the last one is at the bottom
+		virtual void write_batch(const unsigned char* rows, int nr_rows) = 0;
+
+		// called after the last batch
+		virtual void finish() = 0;
+
+	private:
+		int batch_rows = 0;
+		int nr_buffered = 0;
+		std::vector<unsigned char> buf;
+};
+
+}
@@ -15,6 +15,7 @@
 #include <type_traits>
 
 #ifdef _WIN32
+#include <direct.h>
 #define __attribute__(x)
 #endif
 
@@ -84,6 +85,16 @@ inline bool exists_file(const char* name) {
 	return stat(name, &buffer) == 0;
 }
 
+// create a directory unless it exists. return whether it exists afterwards
+inline bool make_dir(const char* name) {
+#ifdef _WIN32
+	_mkdir(name);
+#else
+	mkdir(name, 0755);
+#endif
+	return exists_file(name);
+}
+
 inline bool endswith(const char* str, const char* suffix) {
 	if (!str || !suffix) return false;
 	auto l1 = strlen(str), l2 = strlen(suffix);
@@ -15,13 +15,17 @@
 #include "lib/planedrawer.hh"
 #include "lib/polygon.hh"
 #include "lib/timer.hh"
+#include "stitch/checkpoint.hh"
 #include "stitch/cylstitcher.hh"
 #include "stitch/match_info.hh"
+#include "stitch/region_renderer.hh"
+#include "stitch/reprojection.hh"
 #include "stitch/stitcher.hh"
 #include "stitch/transform_estimate.hh"
 #include "stitch/warp.hh"
 #include <ctime>
 #include <cassert>
+#include <map>
 
 using namespace std;
 using namespace pano;
@@ -195,7 +199,39 @@ void test_warp(int argc, char* argv[]) {
 }
 
 
-void work(int argc, char* argv[]) {
+// the result file
+const char* output_file() {
+	return DEEPZOOM_TILE_SIZE > 0 ? "out.dzi" : "out.jpg";
+}
+
+void write_output(const Mat32f& res) {
+	GuardedTimer tm("Writing image");
+	write_rgb(output_file(), res);
+}
+
+// render the result quickly from downscaled images, to preview.jpg
+void write_preview(const ConnectedImages& bundle) {
+	GuardedTimer tm("Preview");
+	RegionRenderer renderer(bundle);
+	Coor size = renderer.size();
+	double scale = min(1.0, (double)PREVIEW_SIZE / max(size.x, size.y));
+	write_rgb("preview.jpg", renderer.render(Vec2D(0, 0), Vec2D(size.x, size.y), scale));
+}
+
+// build the result, and write it to output_file()
+void build_output(Stitcher& p) {
+	p.build_bundle();
+	auto& bundle = p.get_bundle();
+	if (PREVIEW_SIZE > 0)
+		write_preview(bundle);
+	// the crop window is found before blending
+	if (STREAM_BLEND)
+		bundle.blend(output_file(), CROP);
+	else
+		write_output(bundle.blend(CROP));
+}
+
+void work(int argc, char* argv[], CheckpointStage resume = CheckpointStage::None) {
 /*
  *  vector<Mat32f> imgs(argc - 1);
  *  {
@@ -207,24 +243,49 @@ void work(int argc, char* argv[]) {
  */
 	vector<string> imgs;
 	REPL(i, 1, argc) imgs.emplace_back(argv[i]);
-	Mat32f res;
 	if (CYLINDER) {
+		if (resume != CheckpointStage::None)
+			error_exit("Cannot resume from checkpoints in cylinder mode!\n");
 		CylinderStitcher p(move(imgs));
-		res = p.build();
+		write_output(p.build());
 	} else {
 		Stitcher p(move(imgs));
-		res = p.build();
+		p.resume_from(resume);
+		build_output(p);
 	}
+}
 
-	if (CROP) {
-		int oldw = res.width(), oldh = res.height();
-		res = crop(res);
-		print_debug("Crop from %dx%d to %dx%d\n", oldh, oldw, res.height(), res.width());
-	}
+// add new images to the panorama saved in checkpoints
+void add_images(int argc, char* argv[]) {
+	if (CYLINDER)
+		error_exit("Cannot add images in cylinder mode!\n");
+	vector<string> imgs = load_checkpoint_image_list(CAMERA_CHECKPOINT);
+	REPL(i, 2, argc) imgs.emplace_back(argv[i]);
+	Stitcher p(move(imgs));
+	p.add_to_checkpoint();
+	build_output(p);
+}
+
+// render a region of the panorama saved in checkpoints, to region.jpg
+void render_region(int argc, char* argv[]) {
+	if (CYLINDER)
+		error_exit("Cannot render from checkpoints in cylinder mode!\n");
+	if (argc < 9)
+		error_exit("Usage: render <x0> <y0> <x1> <y1> <scale> <file1> <file2> ...\n");
+	vector<string> imgs;
+	REPL(i, 7, argc) imgs.emplace_back(argv[i]);
+	Stitcher p(move(imgs));
+	p.resume_from(CheckpointStage::Camera);
+	p.build_bundle();
+
+	RegionRenderer renderer(p.get_bundle());
+	Mat32f res;
 	{
-		GuardedTimer tm("Writing image");
-		write_rgb("out.jpg", res);
+		GuardedTimer tm("render()");
+		res = renderer.render(Vec2D(atof(argv[2]), atof(argv[3])),
+				Vec2D(atof(argv[4]), atof(argv[5])), atof(argv[6]));
 	}
+	write_rgb("region.jpg", res);
 }
 
 void init_config() {
@@ -249,12 +310,23 @@ void init_config() {
 	CFG(ORDERED_INPUT);
 	if (!ORDERED_INPUT && !ESTIMATE_CAMERA)
 		error_exit("Require ORDERED_INPUT under this mode!\n");
+	CFG(GUIDED_MATCHING);
 
 	CFG(CROP);
 	CFG(STRAIGHTEN);
 	CFG(FOCAL_LENGTH);
 	CFG(MAX_OUTPUT_SIZE);
-	CFG(LAZY_READ);	// TODO in cyl mode
+	CFG(PREVIEW_SIZE);
+	CFG(LAZY_READ);
+	CFG(PREFETCH_MEMORY);
+	CFG(IMAGE_CACHE_MEMORY);
+	CFG(PNG_COMPRESSION_LEVEL);
+	if (PNG_COMPRESSION_LEVEL < -1 || PNG_COMPRESSION_LEVEL > 9)
+		error_exit("PNG_COMPRESSION_LEVEL must be -1 or in [0, 9]!\n");
+	CFG(DEEPZOOM_TILE_SIZE);
+	if (DEEPZOOM_TILE_SIZE < 0 || DEEPZOOM_TILE_SIZE % 2)
+		error_exit("DEEPZOOM_TILE_SIZE must be 0 or a positive even number!\n");
+	CFG(CHECKPOINT);
 
 	CFG(SIFT_WORKING_SIZE);
 	CFG(NUM_OCTAVE);
@@ -280,47 +352,58 @@ void init_config() {
 	CFG(SLOPE_PLAIN);
 	CFG(LM_LAMBDA);
 	CFG(MULTIPASS_BA);
+	CFG(HIERARCHICAL_CLUSTER_SIZE);
 	CFG(MULTIBAND);
+	CFG(MULTIBAND_HALF);
+	CFG(STREAM_BLEND);
+	if (STREAM_BLEND && CYLINDER)
+		error_exit("STREAM_BLEND is not available in cylinder mode!\n");
+	CFG(BICUBIC);
 #undef CFG
 }
 
-void planet(const char* fname) {
-	Mat32f test = read_img(fname);
-	int w = test.width(), h = test.height();
-	const int OUTSIZE = 1000, center = OUTSIZE / 2;
-	Mat32f ret(OUTSIZE, OUTSIZE, 3);
-	fill(ret, Color::NO);
-
-	REP(i, OUTSIZE) REP(j, OUTSIZE) {
-		real_t dist = hypot(center - i, center - j);
-		if (dist >= center || dist == 0) continue;
-		dist = dist / center;
-		//dist = sqr(dist);	// TODO you can change this to see different effect
-		dist = h - dist * h;
-
-		real_t theta;
-		if (j == center) {
-			if (i < center)
-				theta = M_PI / 2;
-			else
-				theta = 3 * M_PI / 2;
-		} else {
-			theta = atan((real_t)(center - i) / (center - j));
-			if (theta < 0) theta += M_PI;
-			if ((theta == 0) && (j > center)) theta += M_PI;
-			if (center < i) theta += M_PI;
-		}
-		m_assert(0 <= theta);
-		m_assert(2 * M_PI + EPS >= theta);
+// parse a view from args: <projection> <width> <height> <hfov> <yaw> <pitch> <roll>, angles in degrees
+View parse_view(char* args[]) {
+	static const map<string, View::Projection> names{
+		{"rectilinear", View::rectilinear}, {"stereographic", View::stereographic},
+		{"equirectangular", View::equirectangular}, {"mercator", View::mercator}};
+	auto itr = names.find(args[0]);
+	if (itr == names.end())
+		error_exit("Projection must be one of rectilinear, stereographic, equirectangular and mercator!\n");
+	auto rad = [&](int k) { return atof(args[k]) * M_PI / 180; };
+	return View(itr->second, Coor(atoi(args[1]), atoi(args[2])), rad(3), rad(4), rad(5), rad(6));
+}
 
-		theta = theta / (M_PI * 2) * w;
+// render a view of a finished equirectangular panorama, to view.jpg
+void reproject_panorama(int argc, char* argv[]) {
+	if (argc < 11)
+		error_exit("Usage: reproject <panorama> <panorama_hfov> <projection> <width> <height> <hfov> <yaw> <pitch> <roll>\n");
+	Mat32f pano = read_img(argv[2]);
+	write_rgb("view.jpg", reproject(pano, atof(argv[3]) * M_PI / 180, parse_view(argv + 4)));
+}
 
-		update_min(dist, (real_t)h - 1);
-		Color c = interpolate(test, dist, theta);
-		float* p = ret.ptr(i, j);
-		c.write_to(p);
-	}
-	write_rgb("planet.jpg", ret);
+// render a view of the panorama saved in checkpoints from the images, to view.jpg
+void reproject_view(int argc, char* argv[]) {
+	if (!ESTIMATE_CAMERA)
+		error_exit("Rendering views from checkpoints requires ESTIMATE_CAMERA mode!\n");
+	if (argc < 11)
+		error_exit("Usage: view <projection> <width> <height> <hfov> <yaw> <pitch> <roll> <file1> <file2> ...\n");
+	vector<string> imgs;
+	REPL(i, 9, argc) imgs.emplace_back(argv[i]);
+	Stitcher p(move(imgs));
+	p.resume_from(CheckpointStage::Camera);
+	p.build_bundle();
+	write_rgb("view.jpg", reproject(p.get_bundle(), parse_view(argv + 2)));
+}
+
+// render a panorama covering 360 degrees as a little planet, to planet.jpg
+void planet(const char* fname) {
+	Mat32f pano = read_img(fname);
+	// look down at the nadir, and see up to the top of the panorama
+	double top = M_PI / 2 + M_PI * pano.height() / pano.width();
+	View view(View::stereographic, Coor(1000, 1000),
+			min(2 * top, M_PI * 350 / 180), 0, -M_PI / 2);
+	write_rgb("planet.jpg", reproject(pano, 2 * M_PI, view));
 }
 
 int main(int argc, char* argv[]) {
@@ -344,6 +427,20 @@ int main(int argc, char* argv[]) {
 		test_warp(argc, argv);
 	else if (command == "planet")
 		planet(argv[2]);
+	else if (command == "resume_feature")	// reuse features
+		work(argc - 1, argv + 1, CheckpointStage::Feature);
+	else if (command == "resume_match")		// reuse features and matches
+		work(argc - 1, argv + 1, CheckpointStage::Match);
+	else if (command == "resume_camera")	// reuse everything before blending
+		work(argc - 1, argv + 1, CheckpointStage::Camera);
+	else if (command == "add")		// add images to the checkpoints
+		add_images(argc, argv);
+	else if (command == "render")		// render a region from the checkpoints
+		render_region(argc, argv);
+	else if (command == "view")		// render a view from the checkpoints
+		reproject_view(argc, argv);
+	else if (command == "reproject")		// render a view of a finished panorama
+		reproject_panorama(argc, argv);
 	else
 		// the real routine
 		work(argc, argv);
@@ -4,95 +4,198 @@
 #include "blender.hh"
 
 #include <iostream>
+#include <algorithm>
 #include "lib/config.hh"
 #include "lib/imgproc.hh"
+#include "lib/sampler.hh"
 #include "lib/timer.hh"
+#include "lib/prefetcher.hh"
 using namespace std;
 using namespace config;
 
 namespace pano {
 
+vector<BlenderBase::Span> BlenderBase::coverage_of_row(int i, int width,
+		const vector<const Range*>& ranges) {
+	vector<int> on_row, xs;
+	REP(k, (int)ranges.size()) {
+		auto& r = *ranges[k];
+		if (i < r.min.y || i > r.max.y) continue;
+		on_row.emplace_back(k);
+		xs.emplace_back(max(r.min.x, 0));
+		xs.emplace_back(min(r.max.x + 1, width));
+	}
+	sort(xs.begin(), xs.end());
+	xs.erase(unique(xs.begin(), xs.end()), xs.end());
+
+	vector<Span> ret;
+	for (size_t k = 0; k + 1 < xs.size(); k ++) {
+		Span s{xs[k], xs[k + 1] - 1, {}};
+		for (int id : on_row)
+			if (ranges[id]->contain(i, s.l))
+				s.ids.emplace_back(id);
+		if (not s.ids.empty())
+			ret.emplace_back(move(s));
+	}
+	return ret;
+}
+
 void LinearBlender::add_image(
 			const Coor& upper_left,
 			const Coor& bottom_right,
 			ImageRef &img,
-			std::function<Vec2D(Coor)> coor_func) {
-	images.emplace_back(ImageToAdd{Range{upper_left, bottom_right}, img, coor_func});
+			std::function<Vec2D(Coor)> coor_func,
+			RowMapper row_func) {
+	images.emplace_back(ImageToAdd{Range{upper_left, bottom_right}, img, coor_func, row_func});
 	target_size.update_max(bottom_right);
 }
 
-Mat32f LinearBlender::run() {
-	Mat32f target(target_size.y, target_size.x, 3);
+namespace {
+// weight of pixel (r, c) of img, the largest at its center
+inline float linear_weight(float r, float c, const ImageRef& img) {
+	float w = 0.5 - fabs(c / img.width() - 0.5);
+	if (not ORDERED_INPUT)	// blend both direction
+		w *= (0.5 - fabs(r / img.height() - 0.5));
+	return w;
+}
+}
 
-#define GET_COLOR_AND_W \
-					Vec2D img_coor = img.map_coor(i, j); \
-					if (img_coor.isNaN()) continue; \
-					float r = img_coor.y, c = img_coor.x; \
-					auto color = interpolate(*img.imgref.img, r, c); \
-					if (color.x < 0) continue; \
-					float	w = 0.5 - fabs(c / img.imgref.width() - 0.5); \
-					if (not config::ORDERED_INPUT) /* blend both direction */\
-						w *= (0.5 - fabs(r / img.imgref.height() - 0.5)); \
-					color *= w
+Mat32f LinearBlender::run() {
+	Mat32f target;
 
 	if (LAZY_READ) {
-		// use weighted pixel, to iterate over images (and free them) instead of target
-		// will be a little bit slower
-		Mat<float> weight(target_size.y, target_size.x, 1);
-		memset(weight.ptr(), 0, target_size.y * target_size.x * sizeof(float));
-		fill(target, Color::BLACK);
+		// render by bands of rows, so only images covering a band are loaded
+		target = Mat32f(target_size.y, target_size.x, 3);
+		fill(target, Color::NO);
+		render_bands([&](int y0, int y1, const vector<const ImageToAdd*>& imgs) {
 #pragma omp parallel for schedule(dynamic)
-		REP(k, images.size()) {
-			auto& img = images[k];
-			img.imgref.load();
-			auto& range = img.range;
-			for (int i = range.min.y; i < range.max.y; ++i) {
-				float *row = target.ptr(i);
-				float *wrow = weight.ptr(i);
-				for (int j = range.min.x; j < range.max.x; ++j) {
-					GET_COLOR_AND_W;
-					//#pragma omp critical
-					{
-						row[j*3] += color.x;
-						row[j*3+1] += color.y;
-						row[j*3+2] += color.z;
-						wrow[j] += w;
-					}
-				}
-			}
-			img.imgref.release();
-		}
+			REPL(i, y0, y1)
+				render_row(i, target.ptr(i), imgs);
+		});
+	} else {
+#pragma omp parallel for schedule(dynamic)
+		REP(k, images.size()) images[k].imgref.load();
+		target = run_loaded();
+	}
+	return target;
+}
+
+Mat32f LinearBlender::run_loaded() const {
+	Mat32f target(target_size.y, target_size.x, 3);
+	fill(target, Color::NO);
+	vector<const ImageToAdd*> all;
+	for (auto& img : images) all.emplace_back(&img);
 #pragma omp parallel for schedule(dynamic)
-		REP(i, target.height()) {
-			auto row = target.ptr(i);
-			auto wrow = weight.ptr(i);
-			REP(j, target.width()) {
-				if (wrow[j]) {
-					*(row++) /= wrow[j]; *(row++) /= wrow[j]; *(row++) /= wrow[j];
-				} else {
-					*(row++) = -1; *(row++) = -1; *(row++) = -1;
-				}
+	for (int i = 0; i < target.height(); i ++)
+		render_row(i, target.ptr(i), all);
+	return target;
+}
+
+void LinearBlender::render_row(int i, float* row,
+		const vector<const ImageToAdd*>& imgs) const {
+	vector<const Range*> ranges;
+	for (auto imgptr : imgs) ranges.emplace_back(&imgptr->range);
+	auto mode = config_interpolation();
+	vector<float> rs, cs, colors, isum, wsum;
+	vector<unsigned char> valid;
+	for (auto& s : coverage_of_row(i, target_size.x, ranges)) {
+		int n = s.r - s.l + 1;
+		rs.resize(n), cs.resize(n), valid.resize(n);
+		if (s.ids.size() == 1) {
+			// covered by one image only: no need to weight.
+			// pixels not on the image are written as Color::NO, as they were
+			auto& img = *imgs[s.ids[0]];
+			img.map_row(i, s.l, s.r, rs.data(), cs.data());
+			sample_row(*img.imgref.img, rs.data(), cs.data(), n,
+					row + s.l * 3, valid.data(), mode);
+			continue;
+		}
+		colors.resize(n * 3);
+		isum.assign(n * 3, 0);
+		wsum.assign(n, 0);
+		for (int id : s.ids) {
+			auto& img = *imgs[id];
+			img.map_row(i, s.l, s.r, rs.data(), cs.data());
+			sample_row(*img.imgref.img, rs.data(), cs.data(), n,
+					colors.data(), valid.data(), mode);
+			REP(k, n) {
+				if (! valid[k]) continue;
+				float w = linear_weight(rs[k], cs[k], img.imgref);
+				REP(ch, 3) isum[k * 3 + ch] += colors[k * 3 + ch] * w;
+				wsum[k] += w;
 			}
 		}
-	} else {
-		fill(target, Color::NO);
+		float* p = row + s.l * 3;
+		REP(k, n) {
+			if (wsum[k] > 0)	// keep original Color::NO
+				REP(ch, 3) p[k * 3 + ch] = isum[k * 3 + ch] / wsum[k];
+		}
+	}
+}
+
+void LinearBlender::run_strips(StripWriter& out) {
+	m_assert(out.width() == target_size.x && out.height() == target_size.y);
+	int strip_rows = max(1, STREAM_STRIP_PIXELS / target_size.x);
+	Mat32f strip(min(strip_rows, target_size.y), target_size.x, 3);
+	render_bands([&](int y0, int y1, const vector<const ImageToAdd*>& imgs) {
+		if (strip.rows() != y1 - y0)
+			strip = Mat32f(y1 - y0, target_size.x, 3);
+		fill(strip, Color::NO);
 #pragma omp parallel for schedule(dynamic)
-		for (int i = 0; i < target.height(); i ++) {
-			float *row = target.ptr(i);
-			for (int j = 0; j < target.width(); j ++) {
-				Color isum = Color::BLACK;
-				float wsum = 0;
-				for (auto& img : images) if (img.range.contain(i, j)) {
-					GET_COLOR_AND_W;
-					isum += color;
-					wsum += w;
-				}
-				if (wsum > 0)	// keep original Color::NO
-					(isum / wsum).write_to(row + j * 3);
-			}
+		REPL(i, y0, y1)
+			render_row(i, strip.ptr(i - y0), imgs);
+		out.write(strip);
+	});
+}
+
+void LinearBlender::render_bands(band_func_t render) {
+	int n = images.size();
+	// load images in the order they are first needed
+	vector<int> order(n);
+	REP(k, n) order[k] = k;
+	sort(order.begin(), order.end(), [&](int a, int b) {
+		return images[a].range.min.y < images[b].range.min.y;
+	});
+	Prefetcher prefetcher(n, [&](int k) {
+		auto& ref = images[order[k]].imgref;
+		ref.load();
+		return ref.nr_bytes();
+	}, (size_t)PREFETCH_MEMORY << 20, PREFETCH_NR_THREAD);
+
+	int band_rows = max(1, STREAM_STRIP_PIXELS / target_size.x);
+	vector<int> active;		// positions in order, of the loaded images
+	int next = 0;
+	for (int y0 = 0; y0 < target_size.y; y0 += band_rows) {
+		int y1 = min(y0 + band_rows, target_size.y);
+		while (next < n && images[order[next]].range.min.y < y1) {
+			prefetcher.wait(next);
+			active.emplace_back(next++);
 		}
+		// blend in the same order as run_loaded()
+		vector<const ImageToAdd*> imgs;
+		for (int k : active) imgs.emplace_back(&images[order[k]]);
+		sort(imgs.begin(), imgs.end());
+		render(y0, y1, imgs);
+
+		// images above the next band are not needed any more
+		active.erase(remove_if(active.begin(), active.end(), [&](int k) {
+			auto& img = images[order[k]];
+			if (img.range.max.y >= y1)
+				return false;
+			img.imgref.release();
+			prefetcher.done(k);
+			return true;
+		}), active.end());
+	}
+	// the ones reaching the bottom
+	while (next < n) {
+		prefetcher.wait(next);
+		active.emplace_back(next++);
+	}
+	for (int k : active) {
+		images[order[k]].imgref.release();
+		prefetcher.done(k);
 	}
-	return target;
 }
 
 }
@@ -7,6 +7,7 @@
 #include "lib/mat.h"
 #include "lib/geometry.hh"
 #include "lib/color.hh"
+#include "lib/strip_writer.hh"
 #include "imageref.hh"
 
 namespace pano {
@@ -31,10 +32,15 @@ class BlenderBase {
 			}
 		};
 
+		// maps pixels [l, r] on row i of target to the image, into rows and cols of the image.
+		// points out of the image can be anything rejected by sample_row()
+		typedef std::function<void(int i, int l, int r, float* rows, float* cols)> RowMapper;
+
 		struct ImageToAdd {
 			Range range;
 			ImageRef& imgref;
 			std::function<Vec2D(Coor)> coor_func;
+			RowMapper row_func;		// optional. the same mapping as coor_func, by rows
 
 			Vec2D map_coor(int r, int c) const {
 				auto ret = coor_func(Coor(c, r));
@@ -42,6 +48,20 @@ class BlenderBase {
 					ret = Vec2D::NaN();
 				return ret;
 			}
+
+			// map pixels [l, r] on row i of target to the image, by row_func if given,
+			// otherwise as map_coor()
+			void map_row(int i, int l, int r, float* rows, float* cols) const {
+				if (row_func) {
+					row_func(i, l, r, rows, cols);
+					return;
+				}
+				for (int j = l; j <= r; j ++) {
+					Vec2D p = map_coor(i, j);
+					*(rows++) = p.y;
+					*(cols++) = p.x;
+				}
+			}
 		};
 
 		BlenderBase(const BlenderBase&) = delete;
@@ -49,13 +69,30 @@ class BlenderBase {
 
 		// upper_left/bottom_right: range of img on result image
 		// coor_func: the function maps from target coordinate to original image coordinate.
+		// row_func: optionally the same mapping by rows, used in the blending loops
 		virtual void add_image(
 				const Coor& upper_left,
 				const Coor& bottom_right,
 				ImageRef &img,
-				std::function<Vec2D(Coor)> coor_func) = 0;
+				std::function<Vec2D(Coor)> coor_func,
+				RowMapper row_func = nullptr) = 0;
 
 		virtual Mat32f run() = 0;
+
+		// render the target by strips of rows from top to bottom and write them to out
+		virtual void run_strips(StripWriter& out) = 0;
+
+	protected:
+		// pixels [l, r] on a row, covered by the same set of images
+		struct Span {
+			int l, r;
+			std::vector<int> ids;		// indices into the ranges, in increasing order
+		};
+
+		// split row i of a target of this width into spans by the ranges covering it.
+		// pixels covered by no range are not in any span
+		static std::vector<Span> coverage_of_row(int i, int width,
+				const std::vector<const Range*>& ranges);
 };
 
 class LinearBlender : public BlenderBase {
@@ -63,15 +100,41 @@ class LinearBlender : public BlenderBase {
 
 	Coor target_size{0, 0};
 
+	// blend row i of target from imgs. uncovered pixels are untouched
+	void render_row(int i, float* row,
+			const std::vector<const ImageToAdd*>& imgs) const;
+
+	// render rows [y0, y1) of target from imgs
+	typedef std::function<void(int y0, int y1,
+			const std::vector<const ImageToAdd*>& imgs)> band_func_t;
+
+	// call render on bands of rows from top to bottom, with the images covering each band.
+	// each image is loaded for the first band it covers, and released after the last one
+	void render_bands(band_func_t render);
+
 	public:
+	LinearBlender() = default;
+
+	// the target is at least of this size
+	explicit LinearBlender(Coor target_size): target_size(target_size) {}
+
 	void add_image(
 			const Coor& upper_left,
 			const Coor& bottom_right,
 			ImageRef &img,
-			std::function<Vec2D(Coor)>) override;
+			std::function<Vec2D(Coor)>,
+			RowMapper row_func = nullptr) override;
 
 	Mat32f run() override;
 
+	// blend the images which are all loaded already, and keep them loaded
+	Mat32f run_loaded() const;
+
+	// each image is loaded for the first strip it covers, and released after the last one
+	void run_strips(StripWriter& out) override;
+
+	Coor size() const { return target_size; }
+
 	// render each component, for debug
 	void debug_run(int w, int h);
 };
@@ -8,7 +8,7 @@
 #include <string>
 
 #include "lib/timer.hh"
-#include "match_info.hh"
+#include "match_graph.hh"
 #include "homography.hh"
 using namespace std;
 using namespace pano;
@@ -67,11 +67,12 @@ Homography Camera::K() const {
 }
 
 double Camera::estimate_focal(
-		const vector<vector<MatchInfo>>& matches) {
+		const MatchGraph& matches) {
 	int n = matches.size();
 	vector<double> estimates;
-	REP(i, n) REPL(j, i + 1, n) {
-		auto& match = matches[i][j];
+	REP(i, n) for (auto& e : matches.edges(i)) {
+		if (e.to <= i) continue;
+		auto& match = e.info;
 		if (match.confidence < EPS) continue;
 		estimates.emplace_back(
 				get_focal_from_matrix(match.homo));
@@ -6,7 +6,7 @@
 #include "homography.hh"
 
 namespace pano {
-struct MatchInfo;
+class MatchGraph;
 
 // TODO might not need aspect any more
 class Camera {
@@ -29,7 +29,7 @@ class Camera {
 		Homography R; // Rotation
 
 		static double estimate_focal(
-				const std::vector<std::vector<MatchInfo>>& matches);
+				const MatchGraph& matches);
 
 		static void rotation_to_angle(const Homography& r, double& rx, double& ry, double& rz);
 
@@ -4,34 +4,43 @@
 
 #include "camera_estimator.hh"
 #include <queue>
+#include <algorithm>
 
 #include "lib/debugutils.hh"
 #include "lib/timer.hh"
 #include "lib/utils.hh"
 #include "lib/config.hh"
 #include "camera.hh"
-#include "match_info.hh"
+#include "match_graph.hh"
 #include "incremental_bundle_adjuster.hh"
 
 using namespace std;
 using namespace config;
 
+namespace {
+// iterations of the final refinement when adding images
+const static int REFINE_MAX_ITER = 20;
+}
+
 namespace pano {
 
 CameraEstimator::CameraEstimator(
-		std::vector<std::vector<MatchInfo>>& matches,
+		MatchGraph& matches,
 		const std::vector<Shape2D>& image_shapes) :
 		n(matches.size()),
 		matches(matches),
 		shapes(image_shapes),
 		cameras(matches.size())
-	{ m_assert(matches.size() == shapes.size()); }
+	{ m_assert(matches.size() == (int)shapes.size()); }
 
 CameraEstimator::~CameraEstimator() = default;
 
-vector<Camera> CameraEstimator::estimate() {
+vector<Camera> CameraEstimator::estimate(double init_focal) {
 	GuardedTimer tm("Estimate Camera");
-	{ // assign an initial focal length
+	if (init_focal > 0) {
+		for (auto& c : cameras)
+			c.focal = init_focal;
+	} else { // assign an initial focal length
 		double focal = Camera::estimate_focal(matches);
 		if (focal > 0) {
 			for (auto& c : cameras)
@@ -55,23 +64,15 @@ vector<Camera> CameraEstimator::estimate() {
 		},
 		[&](int now, int next) {
 			print_debug("Best edge from %d to %d\n", now, next);
-			auto Kfrom = cameras[now].K();
-			auto Kto = cameras[next].K();
-			auto Hinv = matches[now][next].homo;	// from next to now
-			Kfrom[2] = Kfrom[5] = 0;		// set K to zero, because homo operates on zero-based index
-			auto Mat = Kfrom.inverse() * Hinv * Kto;
-			// this is camera extrincis R, i.e. going from identity to this image
-			cameras[next].R = (cameras[now].Rinv() * Mat).transpose();
-			cameras[next].ppx = shapes[next].halfw();
-			cameras[next].ppy = shapes[next].halfh();
-
+			init_camera_by_edge(now, next);
 			//cameras[next] = cameras[now];	 // initialize by the last camera. seems better?
 
 			if (MULTIPASS_BA > 0) {
 				// add next to BA
 				vst[now] = vst[next] = true;
-				REP(i, n) if (vst[i] && i != next) {
-					auto& m = matches[next][i];
+				for (auto& e : matches.edges(next)) if (vst[e.to]) {
+					int i = e.to;
+					auto& m = e.info;
 					if (m.match.size() && m.confidence > 0) {
 						iba.add_match(i, next, m);
 						if (MULTIPASS_BA == 2) {
@@ -86,8 +87,10 @@ vector<Camera> CameraEstimator::estimate() {
 		});
 
 	if (MULTIPASS_BA == 0) {		// optimize everything together
-		REPL(i, 1, n) REP(j, i) {
-			auto& m = matches[j][i];
+		REPL(i, 1, n) for (auto& e : matches.edges(i)) {
+			int j = e.to;
+			if (j >= i) break;
+			auto& m = matches.at(j, i);		// every match is stored in both directions
 			if (m.match.size() && m.confidence > 0)
 				iba.add_match(i, j, m);
 		}
@@ -98,6 +101,88 @@ vector<Camera> CameraEstimator::estimate() {
 	return cameras;
 }
 
+vector<Camera> CameraEstimator::estimate_incremental(
+		const vector<Camera>& existing) {
+	GuardedTimer tm("Estimate Camera Incrementally");
+	int nr_fixed = existing.size();
+	m_assert(nr_fixed > 0 && nr_fixed < n);
+	REP(i, nr_fixed) cameras[i] = existing[i];
+	vector<bool> vst(n, false);
+	REP(i, nr_fixed) vst[i] = true;
+
+	auto valid_match = [&](const MatchInfo& m) {
+		return m.match.size() && m.confidence > 0;
+	};
+
+	// register new images one by one, through their best edge to registered ones
+	IncrementalBundleAdjuster iba(shapes, cameras);
+	REP(i, nr_fixed) iba.fix_camera(i);
+	REPL(cnt, nr_fixed, n) {
+		int now = -1, next = -1;
+		float best_conf = 0;
+		REP(i, n) if (vst[i]) for (auto& e : matches.edges(i)) if (!vst[e.to]) {
+			if (update_max(best_conf, e.info.confidence))
+				now = i, next = e.to;
+		}
+		if (now == -1) {
+			string unconnected;
+			REPL(i, nr_fixed, n) if (not vst[i])
+				unconnected += to_string(i) + " ";
+			error_exit(ssprintf(
+						"New image %s are not connected to existing ones!", unconnected.c_str()));
+		}
+		print_debug("Register image %d from %d\n", next, now);
+		cameras[next].focal = cameras[now].focal;
+		init_camera_by_edge(now, next);
+		vst[next] = true;
+		for (auto& e : matches.edges(next))
+			if (vst[e.to] && valid_match(e.info))
+				iba.add_match(e.to, next, e.info);
+		iba.optimize();
+	}
+
+	// a bounded refinement on new images and their neighbors,
+	// anchored by the other existing images they connect to
+	vector<bool> is_free(n, false);
+	REPL(i, nr_fixed, n) is_free[i] = true;
+	REPL(i, nr_fixed, n) for (auto& e : matches.edges(i))
+		if (e.to < nr_fixed && valid_match(e.info)) is_free[e.to] = true;
+	if (std::count(is_free.begin(), is_free.begin() + nr_fixed, true) == nr_fixed)
+		REP(j, nr_fixed) is_free[j] = false;	// nothing to anchor to
+
+	IncrementalBundleAdjuster refine(shapes, cameras);
+	REP(i, nr_fixed) if (not is_free[i])
+		refine.fix_camera(i);
+	REPL(i, 1, n) for (auto& e : matches.edges(i)) {
+		int j = e.to;
+		if (j >= i) break;
+		auto& m = matches.at(j, i);		// every match is stored in both directions
+		if ((is_free[i] || is_free[j]) && valid_match(m))
+			refine.add_match(i, j, m);
+	}
+	refine.optimize(REFINE_MAX_ITER);
+	return cameras;
+}
+
+Homography CameraEstimator::rotation_by_match(
+		const Camera& now, const Camera& next, const Homography& Hinv) {
+	auto Kfrom = now.K();
+	auto Kto = next.K();
+	// set K to zero, because homo operates on zero-based index
+	Kfrom[2] = Kfrom[5] = 0;
+	Kto[2] = Kto[5] = 0;
+	auto Mat = Kfrom.inverse() * Hinv * Kto;
+	// this is camera extrincis R, i.e. going from identity to this image
+	return (now.Rinv() * Mat).transpose();
+}
+
+void CameraEstimator::init_camera_by_edge(int now, int next) {
+	cameras[next].R = rotation_by_match(
+			cameras[now], cameras[next], matches.at(now, next).homo);	// homo from next to now
+	cameras[next].ppx = shapes[next].halfw();
+	cameras[next].ppy = shapes[next].halfh();
+}
+
 void CameraEstimator::traverse(
 		function<void(int)> callback_init_node,
 		function<void(int, int)> callback_edge) {
@@ -109,10 +194,10 @@ void CameraEstimator::traverse(
 	};
 	// choose a starting point
 	Edge best_edge{-1, -1, 0};
-	REP(i, n) REPL(j, i+1, n) {
-		auto& m = matches[i][j];
-		if (m.confidence > best_edge.weight)
-			best_edge = Edge{i, j, m.confidence};
+	REP(i, n) for (auto& e : matches.edges(i)) {
+		if (e.to <= i) continue;
+		if (e.info.confidence > best_edge.weight)
+			best_edge = Edge{i, e.to, e.info.confidence};
 	}
 	if (best_edge.v1 == -1)
 		error_exit("No connected images are found!");
@@ -122,10 +207,9 @@ void CameraEstimator::traverse(
 	vector<bool> vst(n, false);
 
 	auto enqueue_edges_from = [&](int from) {
-		REP(i, n) if (i != from && !vst[i]) {
-			auto& m = matches[from][i];
-			if (m.confidence > 0)
-				q.emplace(from, i, m.confidence);
+		for (auto& e : matches.edges(from)) if (!vst[e.to]) {
+			if (e.info.confidence > 0)
+				q.emplace(from, e.to, e.info.confidence);
 		}
 	};
 
@@ -7,14 +7,15 @@
 
 namespace pano {
 
-struct MatchInfo;
+class MatchGraph;
 struct Shape2D;
 class Camera;
+class Homography;
 
 class CameraEstimator {
 	public:
 		CameraEstimator(
-				std::vector<std::vector<MatchInfo>>& matches,
+				MatchGraph& matches,
 				const std::vector<Shape2D>& image_shapes);
 
 		~CameraEstimator();
@@ -22,18 +23,32 @@ class CameraEstimator {
 		CameraEstimator(const CameraEstimator&) = delete;
 		CameraEstimator& operator = (const CameraEstimator&) = delete;
 
-		std::vector<Camera> estimate();
+		// use the given initial focal length if positive, otherwise estimate it
+		std::vector<Camera> estimate(double init_focal = 0);
+
+		// estimate cameras of the images after the given ones,
+		// keeping the given cameras of the first images unchanged
+		std::vector<Camera> estimate_incremental(
+				const std::vector<Camera>& existing);
+
+		// rotation of camera `next`, given camera `now` and their match,
+		// where homo transform next to now
+		static Homography rotation_by_match(
+				const Camera& now, const Camera& next, const Homography& homo);
 
 	private:
 		typedef std::vector<std::vector<int>> Graph;
 
 		int n;	// nr_img
 		// matches will be modified to filter-out low-quality matches
-		std::vector<std::vector<MatchInfo>>& matches;
+		MatchGraph& matches;
 		const std::vector<Shape2D>& shapes;
 
 		std::vector<Camera> cameras;
 
+		// initialize camera of next from a known camera, by their match
+		void init_camera_by_edge(int now, int next);
+
 		void traverse(
 				std::function<void(int)> callback_init_node,
 				std::function<void(int, int)> callback_add_edge);
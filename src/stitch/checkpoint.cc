@@ -0,0 +1,255 @@
+//File: checkpoint.cc
+
+#include "checkpoint.hh"
+
+#include <fstream>
+#include <cstring>
+
+#include "lib/debugutils.hh"
+#include "lib/serialize.hh"
+#include "lib/timer.hh"
+#include "lib/utils.hh"
+#include "camera.hh"
+#include "match_graph.hh"
+#include "stitcher_image.hh"
+using namespace std;
+
+namespace {
+const char MAGIC[8] = {'P', 'A', 'N', 'O', 'C', 'K', 'P', 'T'};
+const int VERSION = 1;
+// bounds of the counts in a checkpoint, to reject corrupted ones before allocating
+const int MAX_NR_IMAGE = 1 << 20;
+const int MAX_NR_FEATURE = 1 << 24;		// of an image
+
+using namespace pano;
+
+void write_header(ostream& os, CheckpointStage stage, const vector<ImageRef>& imgs) {
+	os.write(MAGIC, sizeof(MAGIC));
+	write_pod(os, VERSION);
+	write_pod(os, (int)stage);
+	write_pod(os, (int)imgs.size());
+	for (auto& img : imgs) {
+		write_str(os, img.fname);
+		write_pod(os, img.width());
+		write_pod(os, img.height());
+	}
+}
+
+// read an element count in [0, max], or exit on a corrupted checkpoint
+int read_count(istream& is, const char* fname, long long max) {
+	int n = read_pod<int>(is);
+	if (!is.good() || n < 0 || n > max)
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	return n;
+}
+
+// check magic and version, return the stage
+CheckpointStage read_magic(istream& is, const char* fname) {
+	char magic[sizeof(MAGIC)];
+	is.read(magic, sizeof(magic));
+	if (!is.good() || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		error_exit(ssprintf("%s is not a checkpoint file!", fname));
+	if (read_pod<int>(is) != VERSION)
+		error_exit(ssprintf("Checkpoint %s has an incompatible version!", fname));
+	return (CheckpointStage)read_pod<int>(is);
+}
+
+// check that the checkpoint is produced from the same list of images,
+// and restore the image shapes
+int read_header(istream& is, const char* fname,
+		CheckpointStage stage, vector<ImageRef>& imgs, bool prefix) {
+	if (read_magic(is, fname) != stage)
+		error_exit(ssprintf("Checkpoint %s is saved from another stage!", fname));
+	int n = read_count(is, fname, MAX_NR_IMAGE);
+	if (n > (int)imgs.size() || (!prefix && n != (int)imgs.size()))
+		error_exit(ssprintf("Checkpoint %s has %d images, but %lu are given!",
+					fname, n, imgs.size()));
+	REP(i, n) {
+		auto& img = imgs[i];
+		string saved_name = read_str(is);
+		if (!is.good())
+			error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+		if (saved_name != img.fname)
+			error_exit(ssprintf("Checkpoint %s is saved with image %s, but %s is given!",
+						fname, saved_name.c_str(), img.fname.c_str()));
+		read_pod(is, img._width);
+		read_pod(is, img._height);
+	}
+	return n;
+}
+
+void write_camera(ostream& os, const Camera& c) {
+	write_pod(os, c.focal);
+	write_pod(os, c.aspect);
+	write_pod(os, c.ppx);
+	write_pod(os, c.ppy);
+	write_pod(os, c.R.data);
+}
+
+void read_camera(istream& is, Camera& c) {
+	read_pod(is, c.focal);
+	read_pod(is, c.aspect);
+	read_pod(is, c.ppx);
+	read_pod(is, c.ppy);
+	read_pod(is, c.R.data);
+}
+
+void check_exists(const char* fname) {
+	if (! exists_file(fname))
+		error_exit(ssprintf("Cannot find checkpoint %s. Run with CHECKPOINT enabled first.", fname));
+}
+
+}	// namespace
+
+namespace pano {
+
+vector<string> load_checkpoint_image_list(const char* fname) {
+	check_exists(fname);
+	ifstream fin(fname, ios::binary);
+	read_magic(fin, fname);
+	vector<string> ret(read_count(fin, fname, MAX_NR_IMAGE));
+	for (auto& s : ret) {
+		s = read_str(fin);
+		read_pod<int>(fin), read_pod<int>(fin);	// shape
+	}
+	if (!fin.good())
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	return ret;
+}
+
+void save_feature_checkpoint(
+		const char* fname, const vector<ImageRef>& imgs,
+		const vector<vector<Descriptor>>& feats) {
+	GuardedTimer tm("save_feature_checkpoint()");
+	ofstream fout(fname, ios::binary);
+	m_assert(fout.good());
+	write_header(fout, CheckpointStage::Feature, imgs);
+	for (auto& feat : feats) {
+		write_pod(fout, (int)feat.size());
+		for (auto& d : feat) {
+			write_pod(fout, d.coor);
+			write_vec(fout, d.descriptor);
+		}
+	}
+}
+
+int load_feature_checkpoint(
+		const char* fname, vector<ImageRef>& imgs,
+		vector<vector<Descriptor>>& feats, bool prefix) {
+	GuardedTimer tm("load_feature_checkpoint()");
+	check_exists(fname);
+	ifstream fin(fname, ios::binary);
+	int n = read_header(fin, fname, CheckpointStage::Feature, imgs, prefix);
+	feats.resize(imgs.size());
+	REP(i, n) {
+		feats[i].resize(read_count(fin, fname, MAX_NR_FEATURE));
+		for (auto& d : feats[i]) {
+			read_pod(fin, d.coor);
+			read_vec(fin, d.descriptor);
+		}
+	}
+	if (!fin.good())
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	return n;
+}
+
+void save_match_checkpoint(
+		const char* fname, const vector<ImageRef>& imgs,
+		const MatchGraph& matches) {
+	GuardedTimer tm("save_match_checkpoint()");
+	ofstream fout(fname, ios::binary);
+	m_assert(fout.good());
+	write_header(fout, CheckpointStage::Match, imgs);
+
+	int n = imgs.size(), cnt = 0;
+	m_assert(matches.size() == n);
+	REP(i, n) for (auto& e : matches.edges(i))
+		if (e.info.confidence > 0) cnt ++;
+	write_pod(fout, cnt);
+	REP(i, n) for (auto& e : matches.edges(i)) {
+		if (e.info.confidence <= 0) continue;
+		write_pod(fout, i);
+		write_pod(fout, e.to);
+		e.info.serialize(fout);
+	}
+	print_debug("Saved %d pairwise matches to %s\n", cnt, fname);
+}
+
+int load_match_checkpoint(
+		const char* fname, vector<ImageRef>& imgs,
+		MatchGraph& matches, bool prefix) {
+	GuardedTimer tm("load_match_checkpoint()");
+	check_exists(fname);
+	ifstream fin(fname, ios::binary);
+	int n = read_header(fin, fname, CheckpointStage::Match, imgs, prefix);
+
+	matches = MatchGraph(imgs.size());
+	int cnt = read_count(fin, fname, (long long)n * (n - 1));
+	REP(k, cnt) {
+		int i = read_pod<int>(fin), j = read_pod<int>(fin);
+		if (!fin.good() || i < 0 || i >= n || j < 0 || j >= n)
+			error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+		matches.set(i, j, MatchInfo::deserialize(fin));
+	}
+	if (!fin.good())
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	print_debug("Loaded %d pairwise matches from %s\n", cnt, fname);
+	return n;
+}
+
+void save_camera_checkpoint(
+		const char* fname, const vector<ImageRef>& imgs,
+		const vector<Camera>& cameras, const ConnectedImages& bundle) {
+	GuardedTimer tm("save_camera_checkpoint()");
+	ofstream fout(fname, ios::binary);
+	m_assert(fout.good());
+	write_header(fout, CheckpointStage::Camera, imgs);
+
+	write_pod(fout, (int)cameras.size());
+	for (auto& c : cameras)
+		write_camera(fout, c);
+
+	write_pod(fout, bundle.identity_idx);
+	write_pod(fout, (int)bundle.proj_method);
+	write_pod(fout, bundle.proj_range);
+	for (auto& comp : bundle.component) {
+		write_pod(fout, comp.homo.data);
+		write_pod(fout, comp.homo_inv.data);
+		write_pod(fout, comp.range);
+	}
+	print_debug("Saved cameras and transformations to %s\n", fname);
+}
+
+int load_camera_checkpoint(
+		const char* fname, vector<ImageRef>& imgs,
+		vector<Camera>& cameras, ConnectedImages& bundle, bool prefix) {
+	GuardedTimer tm("load_camera_checkpoint()");
+	check_exists(fname);
+	ifstream fin(fname, ios::binary);
+	int n = read_header(fin, fname, CheckpointStage::Camera, imgs, prefix);
+
+	// no camera if not saved in ESTIMATE_CAMERA mode
+	int nr_camera = read_count(fin, fname, n);
+	if (nr_camera != 0 && nr_camera != n)
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	cameras.resize(nr_camera);
+	for (auto& c : cameras)
+		read_camera(fin, c);
+
+	read_pod(fin, bundle.identity_idx);
+	bundle.proj_method = (ConnectedImages::ProjectionMethod)read_pod<int>(fin);
+	read_pod(fin, bundle.proj_range);
+	m_assert(bundle.component.size() == imgs.size());
+	REP(i, n) {
+		auto& comp = bundle.component[i];
+		read_pod(fin, comp.homo.data);
+		read_pod(fin, comp.homo_inv.data);
+		read_pod(fin, comp.range);
+	}
+	if (!fin.good())
+		error_exit(ssprintf("Checkpoint %s is corrupted!", fname));
+	print_debug("Loaded cameras and transformations from %s\n", fname);
+	return n;
+}
+
+}
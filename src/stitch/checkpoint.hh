@@ -0,0 +1,61 @@
+//File: checkpoint.hh
+
+#pragma once
+#include <string>
+#include <vector>
+#include "feature/feature.hh"
+#include "imageref.hh"
+
+namespace pano {
+
+class MatchGraph;
+struct ConnectedImages;
+class Camera;
+
+// Binary checkpoints of the stitching pipeline, one file per stage.
+// A checkpoint remembers the input files and their shapes,
+// and refuses to be loaded with a different image list.
+// When loading with prefix=true, the checkpoint only needs to
+// cover the first images in the list. Returns the number of images covered.
+enum class CheckpointStage {
+	None = 0,
+	Feature,	// features of each image are known
+	Match,		// pairwise matches are known
+	Camera		// cameras, transformations and projection range are known
+};
+
+const char* const FEATURE_CHECKPOINT = "checkpoint-feature.bin";
+const char* const MATCH_CHECKPOINT = "checkpoint-match.bin";
+const char* const CAMERA_CHECKPOINT = "checkpoint-camera.bin";
+
+// list of image files saved in a checkpoint
+std::vector<std::string> load_checkpoint_image_list(const char* fname);
+
+void save_feature_checkpoint(
+		const char* fname, const std::vector<ImageRef>& imgs,
+		const std::vector<std::vector<Descriptor>>& feats);
+
+int load_feature_checkpoint(
+		const char* fname, std::vector<ImageRef>& imgs,
+		std::vector<std::vector<Descriptor>>& feats, bool prefix = false);
+
+void save_match_checkpoint(
+		const char* fname, const std::vector<ImageRef>& imgs,
+		const MatchGraph& matches);
+
+// will fill in shapes of imgs
+int load_match_checkpoint(
+		const char* fname, std::vector<ImageRef>& imgs,
+		MatchGraph& matches, bool prefix = false);
+
+// cameras can be empty when not estimated
+void save_camera_checkpoint(
+		const char* fname, const std::vector<ImageRef>& imgs,
+		const std::vector<Camera>& cameras, const ConnectedImages& bundle);
+
+// bundle.component has to be initialized to point to imgs
+int load_camera_checkpoint(
+		const char* fname, std::vector<ImageRef>& imgs,
+		std::vector<Camera>& cameras, ConnectedImages& bundle, bool prefix = false);
+
+}
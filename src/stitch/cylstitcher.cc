@@ -8,7 +8,6 @@
 #include "lib/imgproc.hh"
 #include "feature/matcher.hh"
 #include "transform_estimate.hh"
-#include "blender.hh"
 #include "match_info.hh"
 #include "warp.hh"
 
@@ -24,8 +23,8 @@ Mat32f CylinderStitcher::build() {
 	free_feature();
 	bundle.proj_method = ConnectedImages::ProjectionMethod::flat;
 	bundle.update_proj_range();
-	auto ret = bundle.blend();
-	return perspective_correction(ret);
+	perspective_correction();
+	return bundle.blend(CROP);
 }
 
 void CylinderStitcher::build_warp() {;
@@ -43,28 +42,71 @@ void CylinderStitcher::build_warp() {;
 	print_debug("match time: %lf secs\n", timer.duration());
 
 	vector<Homography> bestmat;
-
-	float minslope = numeric_limits<float>::max();
 	float bestfactor = 1;
 	if (n - mid > 1) {
-		float newfactor = 1;
-		// XXX: ugly
-		float slope = update_h_factor(newfactor, minslope, bestfactor, bestmat, matches);
+		// RANSAC only on the initial factor. its inliers are used for all others
+		vector<vector<int>> inliers;
+		float slope = update_h_factor(1, inliers, bestmat, matches);
 		if (bestmat.empty())
 			error_exit("Failed to find hfactor");
 		float centerx1 = 0, centerx2 = bestmat[0].trans2d(0, 0).x;
 		float order = (centerx2 > centerx1 ? 1 : -1);
-		REP(k, 3) {
-			if (fabs(slope) < SLOPE_PLAIN) break;
-			newfactor += (slope < 0 ? order : -order) / (5 * pow(2, k));
-			slope = update_h_factor(newfactor, minslope, bestfactor, bestmat, matches);
+
+		// the search takes at most 3 steps from factor 1, to the larger one when slope < 0.
+		// all factors it may reach form a binary tree, where children of node i are 2i+1, 2i+2.
+		// evaluate them all in parallel, then walk down the tree
+		const int NR_STEP = 3, NR_NODE = (1 << (NR_STEP + 1)) - 1;
+		vector<float> factors(NR_NODE, 1), slopes(NR_NODE);
+		vector<vector<Homography>> mats(NR_NODE);
+		slopes[0] = slope;
+		REP(i, (NR_NODE - 1) / 2) {
+			int k = (int)log2(i + 1);		// depth of node i
+			float step = order / (5 * pow(2, k));
+			factors[2 * i + 1] = factors[i] + step;
+			factors[2 * i + 2] = factors[i] - step;
+		}
+#pragma omp parallel for schedule(dynamic)
+		REPL(i, 1, NR_NODE) {
+			auto inl = inliers;
+			slopes[i] = update_h_factor(factors[i], inl, mats[i], matches);
+		}
+
+		float minslope = fabs(slope);
+		int node = 0;
+		REP(k, NR_STEP) {
+			if (fabs(slopes[node]) < SLOPE_PLAIN) break;
+			node = 2 * node + (slopes[node] < 0 ? 1 : 2);
+			if (update_min(minslope, fabs(slopes[node]))) {
+				bestfactor = factors[node];
+				bestmat = move(mats[node]);
+			}
 		}
 	}
 	print_debug("Best hfactor: %lf\n", bestfactor);
 	CylinderWarper warper(bestfactor);
-	REP(k, n) imgs[k].load();
-#pragma omp parallel for schedule(dynamic)
-	REP(k, n) warper.warp(*imgs[k].img, keypoints[k]);
+	// only keypoints are warped. pixels are sampled through the warp at blending time
+	vector<Shape2D> shapes;
+	const static int BORDER_SAMPLE = 100;
+	REP(k, n) {
+		auto& comp = bundle.component[k];
+		Shape2D shape = imgs[k].shape();
+		// the border is warped together with keypoints, in half-shifted coordinate
+		auto& kpts = keypoints[k];
+		size_t nr_kpt = kpts.size();
+		double mw = shape.w - 1, mh = shape.h - 1;
+		Vec2D corner[4] = {Vec2D(0, 0), Vec2D(mw, 0), Vec2D(mw, mh), Vec2D(0, mh)};
+		REP(c, 4) REP(i, BORDER_SAMPLE) {
+			Vec2D p = corner[c] + (corner[(c + 1) % 4] - corner[c]) * ((double)i / BORDER_SAMPLE);
+			kpts.emplace_back(p.x - shape.w / 2, p.y - shape.h / 2);
+		}
+		comp.unwarp = warper.warp_coor(shape, kpts);
+		comp.warped_shape = Coor(shape.w, shape.h);
+		comp.warped_border.clear();
+		REPL(i, nr_kpt, kpts.size())
+			comp.warped_border.emplace_back(kpts[i].x + shape.w / 2, kpts[i].y + shape.h / 2);
+		kpts.resize(nr_kpt);
+		shapes.emplace_back(shape);
+	}
 
 	// accumulate
 	REPL(k, mid + 1, n) bundle.component[k].homo = move(bestmat[k - mid - 1]);
@@ -74,7 +116,7 @@ void CylinderStitcher::build_warp() {;
 		MatchInfo info;
 		bool succ = TransformEstimation(
 				matches[i], keypoints[i + 1], keypoints[i],
-				imgs[i+1].shape(), imgs[i].shape()).get_transform(&info);
+				shapes[i+1], shapes[i]).get_transform(&info);
 		// Can match before, but not here. This would be a bug.
 		if (! succ)
 			error_exit(ssprintf("Failed to match between image %d and %d.", i, i+1));
@@ -89,10 +131,9 @@ void CylinderStitcher::build_warp() {;
 }
 
 float CylinderStitcher::update_h_factor(float nowfactor,
-		float & minslope,
-		float & bestfactor,
+		vector<vector<int>>& inliers,
 		vector<Homography>& mat,
-		const vector<MatchData>& matches) {
+		const vector<MatchData>& matches) const {
 	const int n = imgs.size(), mid = bundle.identity_idx;
 	const int start = mid, end = n, len = end - start;
 
@@ -108,20 +149,27 @@ float CylinderStitcher::update_h_factor(float nowfactor,
 	REP(k, len)
 		warper.warp(nowimgs[k], nowkpts[k]);
 
+	bool ransac = inliers.empty();
+	if (ransac)
+		inliers.resize(len - 1);
 	vector<Homography> nowmat;		// size = len - 1
 	nowmat.resize(len - 1);
 	bool failed = false;
 #pragma omp parallel for schedule(dynamic)
 	REPL(k, 1, len) {
-		MatchInfo info;
-		bool succ = TransformEstimation(
+		TransformEstimation est(
 				matches[k - 1 + mid], nowkpts[k - 1], nowkpts[k],
-				nowimgs[k-1], nowimgs[k]).get_transform(&info);
-		if (! succ)
-			failed = true;
-		//error_exit("The two image doesn't match. Failed");
-		nowmat[k-1] = info.homo;
+				nowimgs[k-1], nowimgs[k]);
+		if (ransac) {
+			MatchInfo info;
+			if (! est.get_transform(&info, &inliers[k - 1]))
+				failed = true;
+			//error_exit("The two image doesn't match. Failed");
+			nowmat[k-1] = info.homo;
+		} else
+			nowmat[k-1] = est.fit(inliers[k - 1]);
 	}
+	mat.clear();
 	if (failed) return 0;
 
 	REPL(k, 1, len - 1)
@@ -130,31 +178,30 @@ float CylinderStitcher::update_h_factor(float nowfactor,
 	// check the slope of the result image
 	Vec2D center2 = nowmat.back().trans2d(0, 0);
 	const float slope = center2.y/ center2.x;
-	print_debug("slope: %lf\n", slope);
-	if (update_min(minslope, fabs(slope))) {
-		bestfactor = nowfactor;
-		mat = move(nowmat);
-	}
+	print_debug("hfactor %lf, slope: %lf\n", nowfactor, slope);
+	mat = move(nowmat);
 	return slope;
 }
 
-Mat32f CylinderStitcher::perspective_correction(const Mat32f& img) {
-	int w = img.width(), h = img.height();
-	int refw = imgs[bundle.identity_idx].width(),
-			refh = imgs[bundle.identity_idx].height();
+void CylinderStitcher::perspective_correction() {
+	Vec2D resolution = bundle.get_final_resolution();
+	Vec2D size_d = bundle.proj_range.size() / resolution;
+	int w = size_d.x, h = size_d.y;
+	int refw = bundle.component[bundle.identity_idx].width(),
+			refh = bundle.component[bundle.identity_idx].height();
 	auto homo2proj = bundle.get_homo2proj();
 	Vec2D proj_min = bundle.proj_range.min;
 
 	vector<Vec2D> corners;
 	auto cur = &(bundle.component.front());
 	auto to_ref_coor = [&](Vec2D v) {
-		v.x *= cur->imgptr->width(), v.y *= cur->imgptr->height();
+		v.x *= cur->width(), v.y *= cur->height();
 		Vec homo = cur->homo.trans(v);
 		homo.x /= refw, homo.y /= refh;
 		homo.x += 0.5 * homo.z, homo.y += 0.5 * homo.z;
 		Vec2D t_corner = homo2proj(homo);
 		t_corner.x *= refw, t_corner.y *= refh;
-		t_corner = t_corner - proj_min;
+		t_corner = (t_corner - proj_min) / resolution;
 		corners.push_back(t_corner);
 	};
 	to_ref_coor(Vec2D(-0.5, -0.5));
@@ -168,18 +215,9 @@ Mat32f CylinderStitcher::perspective_correction(const Mat32f& img) {
 		Vec2D(0, 0), Vec2D(0, h),
 		Vec2D(w, 0), Vec2D(w, h)};
 	Matrix m = getPerspectiveTransform(corners, corners_std);
-	Homography inv(m);
-
-	LinearBlender blender;
-	ImageRef tmp("this_should_not_be_used");
-	tmp.img = new Mat32f(img);
-	tmp._width = img.width(), tmp._height = img.height();
-	blender.add_image(
-			Coor(0,0), Coor(w,h), tmp,
-			[=](Coor c) -> Vec2D {
-		return inv.trans2d(Vec2D(c.x, c.y));
-	});
-	return blender.run();
+	bundle.post_homo_inv = Homography(m);
+	bundle.post_homo = bundle.post_homo_inv.inverse();
+	bundle.has_post_homo = true;
 }
 
 }
@@ -21,12 +21,18 @@ class CylinderStitcher : public StitcherBase {
 		// build panorama with cylindrical pre-warping
 		void build_warp();
 
-		// in cylindrical mode, search warping parameter for straightening
-		float update_h_factor(float, float&, float&,
-				std::vector<Homography>&,
-				const std::vector<MatchData>&);
-		// in cylindrical mode, perspective correction on the final image
-		Mat32f perspective_correction(const Mat32f&);
+		// warp keypoints of the right half by a factor, and get the transforms
+		// from each of them to the identity into mat. return the slope of the result.
+		// With empty inliers, run RANSAC on each neighbor pair and fill their inliers,
+		// otherwise refit the transforms on them by least squares.
+		// mat is left empty if RANSAC fails
+		float update_h_factor(float factor,
+				std::vector<std::vector<int>>& inliers,
+				std::vector<Homography>& mat,
+				const std::vector<MatchData>& matches) const;
+		// in cylindrical mode, perspective correction on the final image.
+		// it's set to the bundle, to be applied when blending
+		void perspective_correction();
 
 	public:
 		template<typename U, typename X =
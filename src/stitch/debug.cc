@@ -42,20 +42,33 @@ void LinearBlender::debug_run(int w, int h) {
 	}
 }
 
-void MultiBandBlender::debug_level(int level) const {
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::debug_level(int level) const {
 	int imgid = 0;
 	// TODO omp
 	for (auto& t: images) {
-		auto& wimg = t.img;
-		Mat32f img(wimg.rows(), wimg.cols(), 3);
-		Mat32f weight(wimg.rows(), wimg.cols(), 3);
-		REP(i, wimg.rows()) REP(j, wimg.cols()) {
-			if (not t.meta.mask.get(i, j))
-				wimg.at(i, j).c.write_to(img.ptr(i, j));
+		auto& cimg = t.img;
+		auto& range = t.meta.range;
+		Mat32f img(cimg.rows(), cimg.cols(), 3);
+		Mat32f weight(cimg.rows(), cimg.cols(), 3);
+		REP(i, cimg.rows()) REP(j, cimg.cols()) {
+			if (t.valid_on_target(j + range.min.x, i + range.min.y))
+				widen(cimg.at(i, j)).write_to(img.ptr(i, j));
 			else
 				Color::NO.write_to(img.ptr(i, j));
+			int x = j + range.min.x, y = i + range.min.y;
+			float w = label.at(y, x) == imgid;
+			if (level) {
+				const LabelSample* samples[4];
+				float coefs[4];
+				label_grids[level].around(x, y, samples, coefs);
+				w = 0;
+				REP(c, 4) REP(t, LabelSample::N)
+					if (samples[c]->label[t] == imgid)
+						w += coefs[c] * samples[c]->share[t];
+			}
 			float* p = weight.ptr(i, j);
-			p[0] = p[1] = p[2] = wimg.at(i, j).w;
+			p[0] = p[1] = p[2] = w;
 		}
 		print_debug("[MultiBand] debug output image %d\n", imgid);
 		write_rgb(ssprintf("log/multiband%d-%d.jpg", imgid, level), img);
@@ -63,22 +76,28 @@ void MultiBandBlender::debug_level(int level) const {
 		imgid ++;
 	}
 }
+template void MultiBandBlender::debug_level(int) const;
+template void HalfMultiBandBlender::debug_level(int) const;
 
 
 void Stitcher::draw_matchinfo() {
 	int n = imgs.size();
 	REP(i, n) imgs[i].load();
+	vector<pair<int, int>> tasks;
+	REP(i, n) for (auto& e : pairwise_matches.edges(i))
+		if (e.to > i) tasks.emplace_back(i, e.to);
 #pragma omp parallel for schedule(dynamic)
-	REP(i, n) REPL(j, i+1, n) {
+	REP(k, (int)tasks.size()) {
+		int i = tasks[k].first, j = tasks[k].second;
 		Vec2D offset1(imgs[i].width()/2, imgs[i].height()/2);
 		Vec2D offset2(imgs[j].width()/2 + imgs[i].width(), imgs[j].height()/2);
 		Shape2D shape2{imgs[j].width(), imgs[j].height()},
 						shape1{imgs[i].width(), imgs[i].height()};
 
-		auto& m = pairwise_matches[i][j];
+		auto& m = pairwise_matches.at(i, j);
 		if (m.confidence <= 0)
 			continue;
-		list<Mat32f> imagelist{*imgs[i].img, *imgs[j].img};
+		list<Mat32f> imagelist{cvt_uc2f(*imgs[i].img), cvt_uc2f(*imgs[j].img)};
 		Mat32f conc = hconcat(imagelist);
 		PlaneDrawer pld(conc);
 		for (auto& p : m.match) {
@@ -108,35 +127,4 @@ void Stitcher::draw_matchinfo() {
 	}
 }
 
-void Stitcher::dump_matchinfo(const char* fname) const {
-	print_debug("Dump matchinfo to %s\n", fname);
-	ofstream fout(fname);
-	m_assert(fout.good());
-	int n = imgs.size();
-	REP(i, n) REP(j, n) {
-		auto& m = pairwise_matches[i][j];
-		if (m.confidence <= 0) continue;
-		fout << i << " " << j << endl;
-		m.serialize(fout);
-		fout << endl;
-	}
-	fout.close();
-}
-
-void Stitcher::load_matchinfo(const char* fname) {
-	print_debug("Load matchinfo from %s\n", fname);
-	ifstream fin(fname);
-	int i, j;
-	int n = imgs.size();
-	pairwise_matches.resize(n);
-	for (auto& k : pairwise_matches) k.resize(n);
-
-	while (true) {
-		fin >> i >> j;
-		if (fin.eof()) break;
-		pairwise_matches[i][j] = MatchInfo::deserialize(fin);
-	}
-	fin.close();
-}
-
 }
@@ -0,0 +1,214 @@
+//File: hierarchical_estimator.cc
+
+#include "hierarchical_estimator.hh"
+#include <queue>
+#include <algorithm>
+
+#include "lib/debugutils.hh"
+#include "lib/timer.hh"
+#include "lib/utils.hh"
+#include "lib/config.hh"
+#include "camera.hh"
+#include "camera_estimator.hh"
+#include "match_graph.hh"
+#include "incremental_bundle_adjuster.hh"
+
+using namespace std;
+using namespace config;
+
+namespace {
+// iterations of the final refinement on boundary images
+const static int REFINE_MAX_ITER = 20;
+}
+
+namespace pano {
+
+HierarchicalCameraEstimator::HierarchicalCameraEstimator(
+		MatchGraph& matches,
+		const std::vector<Shape2D>& image_shapes,
+		int cluster_size) :
+		n(matches.size()),
+		matches(matches),
+		shapes(image_shapes),
+		cluster_size(cluster_size),
+		cameras(matches.size())
+	{ m_assert(matches.size() == (int)shapes.size() && cluster_size >= 2); }
+
+vector<Camera> HierarchicalCameraEstimator::estimate() {
+	GuardedTimer tm("Estimate Camera Hierarchically");
+	partition();
+	print_debug("Partition %d images into %lu clusters\n", n, clusters.size());
+	estimate_clusters();
+	align_clusters();
+	refine_boundary();
+	if (STRAIGHTEN) Camera::straighten(cameras);
+	return cameras;
+}
+
+void HierarchicalCameraEstimator::partition() {
+	GuardedTimer tm("partition()");
+	cluster_of.assign(n, -1);
+	clusters.clear();
+
+	// seeds are chosen by decreasing sum of confidence
+	vector<pair<float, int>> seeds(n);
+	REP(i, n) {
+		float sum = 0;
+		for (auto& e : matches.edges(i)) sum += e.info.confidence;
+		seeds[i] = {sum, i};
+	}
+	sort(seeds.rbegin(), seeds.rend());
+
+	// grow a cluster from the seed by the best edges, until it's full
+	for (auto& seed : seeds) {
+		if (cluster_of[seed.second] != -1) continue;
+		int id = clusters.size();
+		clusters.emplace_back();
+		priority_queue<pair<float, int>> q;
+		q.emplace(0, seed.second);
+		while (q.size() && (int)clusters[id].size() < cluster_size) {
+			int now = q.top().second;
+			q.pop();
+			if (cluster_of[now] != -1) continue;
+			cluster_of[now] = id;
+			clusters[id].emplace_back(now);
+			for (auto& e : matches.edges(now))
+				if (cluster_of[e.to] == -1 && e.info.confidence > 0)
+					q.emplace(e.info.confidence, e.to);
+		}
+	}
+
+	// a single image cannot be estimated alone. merge it to the cluster of its best neighbor
+	for (auto& c : clusters) if (c.size() == 1) {
+		int i = c[0], best = -1;
+		float best_conf = 0;
+		for (auto& e : matches.edges(i))
+			if (e.to != i && update_max(best_conf, e.info.confidence))
+				best = e.to;
+		if (best == -1)
+			error_exit(ssprintf("Image %d is not connected to others!", i));
+		int target = cluster_of[best];
+		cluster_of[i] = target;
+		clusters[target].emplace_back(i);
+		c.clear();
+	}
+	clusters.erase(remove_if(clusters.begin(), clusters.end(),
+				[](const vector<int>& c) { return c.empty(); }), clusters.end());
+	REP(id, clusters.size()) for (auto& i : clusters[id])
+		cluster_of[i] = id;
+}
+
+void HierarchicalCameraEstimator::estimate_clusters() {
+	GuardedTimer tm("estimate_clusters()");
+	// clusters have to start from the same focal, to be consistent after alignment
+	double focal = Camera::estimate_focal(matches);
+	if (focal > 0)
+		print_debug("Estimated focal: %lf\n", focal);
+	else {
+		print_debug("Cannot estimate focal. Will use a naive one.\n");
+		focal = 0;
+		for (auto& s : shapes) focal += (s.w + s.h) * 0.5;
+		focal /= n;
+	}
+
+	// index of each image within its cluster
+	vector<int> local_idx(n);
+	for (auto& c : clusters)
+		REP(k, c.size()) local_idx[c[k]] = k;
+
+#pragma omp parallel for schedule(dynamic)
+	REP(id, (int)clusters.size()) {
+		auto& nodes = clusters[id];
+		int k = nodes.size();
+		MatchGraph sub(k);
+		vector<Shape2D> sub_shapes;
+		REP(j, k) {
+			sub_shapes.emplace_back(shapes[nodes[j]]);
+			for (auto& e : matches.edges(nodes[j]))
+				if (cluster_of[e.to] == id)
+					sub.set(j, local_idx[e.to], e.info);
+		}
+		auto sub_cameras = CameraEstimator{sub, sub_shapes}.estimate(focal);
+		REP(j, k) cameras[nodes[j]] = sub_cameras[j];
+	}
+}
+
+void HierarchicalCameraEstimator::align_clusters() {
+	GuardedTimer tm("align_clusters()");
+	int nc = clusters.size();
+	struct Link {
+		float weight;
+		int from, to;	// image in the aligned cluster, and the image to be aligned
+		bool operator < (const Link& r) const { return weight < r.weight; }
+	};
+
+	// best boundary match between each pair of clusters
+	vector<vector<Link>> links(nc);
+	REP(i, n) for (auto& e : matches.edges(i)) {
+		int ca = cluster_of[i], cb = cluster_of[e.to];
+		if (ca == cb || e.info.confidence <= 0) continue;
+		auto itr = find_if(links[ca].begin(), links[ca].end(),
+				[&](const Link& l) { return cluster_of[l.to] == cb; });
+		if (itr == links[ca].end())
+			links[ca].emplace_back(Link{e.info.confidence, i, e.to});
+		else if (e.info.confidence > itr->weight)
+			*itr = Link{e.info.confidence, i, e.to};
+	}
+
+	// spanning tree over clusters, from the largest one
+	int root = 0;
+	REP(c, nc) if (clusters[c].size() > clusters[root].size()) root = c;
+	vector<bool> vst(nc, false);
+	priority_queue<Link> q;
+	auto enqueue_links_from = [&](int c) {
+		vst[c] = true;
+		for (auto& l : links[c])
+			if (!vst[cluster_of[l.to]]) q.emplace(l);
+	};
+	enqueue_links_from(root);
+	int cnt = 1;
+	while (q.size()) {
+		Link l = q.top();
+		q.pop();
+		int c = cluster_of[l.to];
+		if (vst[c]) continue;
+		print_debug("Align cluster %d to %d by image %d -> %d\n",
+				c, cluster_of[l.from], l.to, l.from);
+		// rotation of l.to in the aligned frame
+		Homography R = CameraEstimator::rotation_by_match(
+				cameras[l.from], cameras[l.to], matches.at(l.from, l.to).homo);
+		// from the aligned frame to the frame of this cluster
+		Homography T = cameras[l.to].Rinv() * R;
+		for (auto& i : clusters[c])
+			cameras[i].R = cameras[i].R * T;
+		cnt ++;
+		enqueue_links_from(c);
+	}
+	if (cnt != nc)
+		error_exit(ssprintf(
+					"Found %d connected clusters out of %d, images are not connected well!", cnt, nc));
+}
+
+void HierarchicalCameraEstimator::refine_boundary() {
+	GuardedTimer tm("refine_boundary()");
+	vector<bool> is_free(n, false);
+	REP(i, n) for (auto& e : matches.edges(i))
+		if (cluster_of[e.to] != cluster_of[i])
+			is_free[i] = true;
+
+	IncrementalBundleAdjuster iba(shapes, cameras);
+	iba.use_sparse_solver();
+	REP(i, n) if (not is_free[i])
+		iba.fix_camera(i);
+	REPL(i, 1, n) for (auto& e : matches.edges(i)) {
+		int j = e.to;
+		if (j >= i) break;
+		if (not is_free[i] && not is_free[j]) continue;
+		auto& m = matches.at(j, i);		// every match is stored in both directions
+		if (m.match.size() && m.confidence > 0)
+			iba.add_match(i, j, m);
+	}
+	iba.optimize(REFINE_MAX_ITER);
+}
+
+}
@@ -0,0 +1,53 @@
+//File: hierarchical_estimator.hh
+
+#pragma once
+#include <vector>
+
+namespace pano {
+
+class MatchGraph;
+struct Shape2D;
+class Camera;
+
+// Estimate cameras of a large set of images by divide-and-conquer:
+// 1. partition the match graph into connected clusters of bounded size
+// 2. estimate cameras in each cluster independently, with CameraEstimator
+// 3. rotate each cluster into a common frame, through their best boundary match
+// 4. refine cameras of the boundary images, keeping the others fixed
+class HierarchicalCameraEstimator {
+	public:
+		HierarchicalCameraEstimator(
+				MatchGraph& matches,
+				const std::vector<Shape2D>& image_shapes,
+				int cluster_size);
+
+		HierarchicalCameraEstimator(const HierarchicalCameraEstimator&) = delete;
+		HierarchicalCameraEstimator& operator = (const HierarchicalCameraEstimator&) = delete;
+
+		std::vector<Camera> estimate();
+
+	private:
+		int n;	// nr_img
+		MatchGraph& matches;
+		const std::vector<Shape2D>& shapes;
+		int cluster_size;
+
+		std::vector<Camera> cameras;
+
+		// cluster id of each image
+		std::vector<int> cluster_of;
+		// images in each cluster
+		std::vector<std::vector<int>> clusters;
+
+		void partition();
+
+		// estimate cameras within each cluster, in their own frame
+		void estimate_clusters();
+
+		// rotate all clusters to the frame of the largest one
+		void align_clusters();
+
+		void refine_boundary();
+};
+
+}
@@ -4,25 +4,47 @@
 #pragma once
 #include <string>
 #include <memory>
+#include <vector>
 #include "lib/mat.h"
 #include "lib/imgproc.hh"
+#include "lib/image_cache.hh"
 #include "match_info.hh"
 
 namespace pano {
-		// A transparent reference to a image in file
+		// A transparent reference to a image in file, kept in 8-bit
 		struct ImageRef {
 			std::string fname;
-			Mat32f* img = nullptr;
+			Matuc* img = nullptr;
+			// file content of the loaded image, kept for ImageCache
+			std::vector<unsigned char> encoded;
 			int _width, _height;
 
 			void load() {
 				if (img) return;
-				img = new Mat32f{read_img(fname.c_str())};
+				img = new Matuc;
+				ImageCache::instance().load(fname, *img, encoded);
 				_width = img->width();
 				_height = img->height();
 			}
 
-			void release() { if (img) delete img; img = nullptr; }
+			// grey image for feature detection, which may be downscaled. fill in the shape
+			Mat32f load_grey(int min_size) {
+				return read_img_grey(fname.c_str(), min_size, _width, _height);
+			}
+
+			// memory used by the loaded image
+			size_t nr_bytes() const {
+				return img ? (size_t)img->pixels() * img->channels() + encoded.size() : 0;
+			}
+
+			// the decoded image goes to ImageCache, to be loaded again cheaply
+			void release() {
+				if (! img) return;
+				ImageCache::instance().put(fname, *img, std::move(encoded));
+				encoded.clear();
+				delete img;
+				img = nullptr;
+			}
 
 			int width() const { return _width; }
 			int height() const { return _height; }
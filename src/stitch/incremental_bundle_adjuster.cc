@@ -4,6 +4,7 @@
 #include "incremental_bundle_adjuster.hh"
 
 #include <Eigen/Dense>
+#include <Eigen/Sparse>
 #include <cmath>
 #include <memory>
 #include <array>
@@ -21,7 +22,6 @@ namespace {
 const static int NR_PARAM_PER_CAMERA = 6;
 const static int NR_TERM_PER_MATCH = 2;
 const static bool SYMBOLIC_DIFF = true;
-const static int LM_MAX_ITER = 100;
 const static float ERROR_IGNORE = 500.f;
 
 inline void camera_to_params(const Camera& c, double* ptr) {
@@ -117,14 +117,21 @@ void IncrementalBundleAdjuster::add_match(
 	idx_added.insert(j);
 }
 
-void IncrementalBundleAdjuster::optimize() {
+void IncrementalBundleAdjuster::optimize(int max_iter) {
 	if (idx_added.empty())
 		return;
 	using namespace Eigen;
 	update_index_map();
 	int nr_img = idx_added.size();
-	J = MatrixXd{NR_TERM_PER_MATCH * nr_pointwise_match, NR_PARAM_PER_CAMERA * nr_img};
-	JtJ = MatrixXd{NR_PARAM_PER_CAMERA * nr_img, NR_PARAM_PER_CAMERA * nr_img};
+	if (! SYMBOLIC_DIFF)
+		J = MatrixXd{NR_TERM_PER_MATCH * nr_pointwise_match, NR_PARAM_PER_CAMERA * nr_img};
+	if (sparse) {
+		m_assert(SYMBOLIC_DIFF);
+		JtJ_diag.resize(nr_img);
+		JtJ_pair.resize(match_pairs.size());
+	} else
+		JtJ = MatrixXd{NR_PARAM_PER_CAMERA * nr_img, NR_PARAM_PER_CAMERA * nr_img};
+	Jtr = VectorXd{NR_PARAM_PER_CAMERA * nr_img};
 
 	ParamState state;
 	for (auto& idx : idx_added)
@@ -138,7 +145,7 @@ void IncrementalBundleAdjuster::optimize() {
 	int itr = 0;
 	int nr_non_decrease = 0;// number of non-decreasing iteration
 	inlier_threshold = std::numeric_limits<int>::max();
-	while (itr++ < LM_MAX_ITER) {
+	while (itr++ < max_iter) {
 		auto update = get_param_update(state, err_stat.residuals, LM_LAMBDA);
 
 		ParamState new_state;
@@ -162,8 +169,11 @@ void IncrementalBundleAdjuster::optimize() {
 
 	auto results = state.get_cameras();
 	int now = 0;
-	for (auto& i : idx_added)
-		result_cameras[i] = results[now++];
+	for (auto& i : idx_added) {
+		if (not idx_fixed.count(i))
+			result_cameras[i] = results[now];
+		now ++;
+	}
 }
 
 IncrementalBundleAdjuster::ErrorStats IncrementalBundleAdjuster::calcError(
@@ -241,14 +251,27 @@ Eigen::VectorXd IncrementalBundleAdjuster::get_param_update(
 	using namespace Eigen;
 	int nr_img = idx_added.size();
 	if (! SYMBOLIC_DIFF) {
-		calcJacobianNumerical(state);
+		calcJacobianNumerical(state, residual);
 	} else {
-		calcJacobianSymbolic(state);
+		calcJacobianSymbolic(state, residual);
 		// check correctness
 		// PP((JtJ - J.transpose() * J).eval().maxCoeff());
 	}
-	Map<const VectorXd> err_vec(residual.data(), NR_TERM_PER_MATCH * nr_pointwise_match);
-	auto b = J.transpose() * err_vec;
+	if (sparse)
+		return solve_sparse(lambda);
+	VectorXd& b = Jtr;
+
+	// fixed cameras get zero update
+	for (auto& i : idx_fixed) {
+		if (not idx_added.count(i)) continue;
+		int start = index_map[i] * NR_PARAM_PER_CAMERA;
+		REP(k, NR_PARAM_PER_CAMERA) {
+			JtJ.row(start + k).setZero();
+			JtJ.col(start + k).setZero();
+			JtJ(start + k, start + k) = 1;
+			b(start + k) = 0;
+		}
+	}
 
 	REP(i, nr_img * NR_PARAM_PER_CAMERA) {
 		// use different lambda for different param? from Lowe.
@@ -263,7 +286,61 @@ Eigen::VectorXd IncrementalBundleAdjuster::get_param_update(
 	return JtJ.colPivHouseholderQr().solve(b).eval();
 }
 
-void IncrementalBundleAdjuster::calcJacobianNumerical(const ParamState& old_state) {
+Eigen::VectorXd IncrementalBundleAdjuster::solve_sparse(float lambda) {
+	TotalTimer tm("solve_sparse");
+	using namespace Eigen;
+	int nr_img = idx_added.size();
+	vector<bool> is_fixed(nr_img, false);
+	for (auto& i : idx_fixed)
+		if (idx_added.count(i))
+			is_fixed[index_map[i]] = true;
+
+	vector<Triplet<double>> triplets;
+	triplets.reserve((nr_img + match_pairs.size() * 2) * sqr(NR_PARAM_PER_CAMERA));
+	REP(k, nr_img) {
+		int start = k * NR_PARAM_PER_CAMERA;
+		if (is_fixed[k]) {
+			// fixed cameras get zero update
+			REP(i, NR_PARAM_PER_CAMERA) {
+				triplets.emplace_back(start + i, start + i, 1);
+				Jtr(start + i) = 0;
+			}
+			continue;
+		}
+		REP(i, NR_PARAM_PER_CAMERA) REP(j, NR_PARAM_PER_CAMERA) {
+			double val = JtJ_diag[k](i, j);
+			if (i == j)		// the same lambda as the dense solver
+				val += i >= 3 ? lambda : lambda / 10;
+			triplets.emplace_back(start + i, start + j, val);
+		}
+	}
+	REP(pair_idx, match_pairs.size()) {
+		int from = index_map[match_pairs[pair_idx].from],
+				to = index_map[match_pairs[pair_idx].to];
+		if (is_fixed[from] || is_fixed[to])
+			continue;
+		auto& blk = JtJ_pair[pair_idx];
+		REP(i, NR_PARAM_PER_CAMERA) REP(j, NR_PARAM_PER_CAMERA) {
+			int i1 = from * NR_PARAM_PER_CAMERA + i,
+					i2 = to * NR_PARAM_PER_CAMERA + j;
+			triplets.emplace_back(i1, i2, blk(i, j));
+			triplets.emplace_back(i2, i1, blk(i, j));
+		}
+	}
+	int nr_param = nr_img * NR_PARAM_PER_CAMERA;
+	SparseMatrix<double> A(nr_param, nr_param);
+	A.setFromTriplets(triplets.begin(), triplets.end());		// duplicates are summed
+
+	SimplicialLDLT<SparseMatrix<double>> solver(A);
+	if (solver.info() != Success) {
+		print_debug("BA: sparse factorization failed\n");
+		return VectorXd::Zero(nr_param);
+	}
+	return solver.solve(Jtr);
+}
+
+void IncrementalBundleAdjuster::calcJacobianNumerical(
+		const ParamState& old_state, const vector<double>& residual) {
 	TotalTimer tm("calcJacobianNumerical");
 	// Numerical Differentiation of Residual w.r.t all parameters
 	const static double step = 1e-6;
@@ -284,14 +361,20 @@ void IncrementalBundleAdjuster::calcJacobianNumerical(const ParamState& old_stat
 		}
 	}
 	JtJ = (J.transpose() * J).eval();
+	Eigen::Map<const Eigen::VectorXd> err_vec(residual.data(), NR_TERM_PER_MATCH * nr_pointwise_match);
+	Jtr = (J.transpose() * err_vec).eval();
 }
 
-void IncrementalBundleAdjuster::calcJacobianSymbolic(const ParamState& state) {
+void IncrementalBundleAdjuster::calcJacobianSymbolic(
+		const ParamState& state, const vector<double>& residual) {
 	// Symbolic Differentiation of Residual w.r.t all parameters
 	// See Section 4 of: Automatic Panoramic Image Stitching using Invariant Features - David Lowe,IJCV07.pdf
 	TotalTimer tm("calcJacobianSymbolic");
-	J.setZero();	// this took 1/3 time. J.rows() could reach 130000
-	JtJ.setZero();
+	if (sparse) {
+		for (auto& b : JtJ_diag) b.setZero();
+	} else
+		JtJ.setZero();
+	Jtr.setZero();
 	const auto& cameras = state.get_cameras();
 	// pre-calculate all derivatives of R
 	vector<array<Homography, 3>> all_dRdvi(cameras.size());
@@ -318,6 +401,8 @@ void IncrementalBundleAdjuster::calcJacobianSymbolic(const ParamState& state) {
 		Vec2D mid_vec_to = shapes[pair.to].center();
 		Vec2D mid_vec_from = shapes[pair.from].center();
 
+		// blocks of JtJ by this pair: from-from, to-to, and from-to
+		JtJBlock ff = JtJBlock::Zero(), tt = JtJBlock::Zero(), ft = JtJBlock::Zero();
 		for (const auto& p : pair.m.match) {
 			Vec2D to = p.first + mid_vec_to;
 			Vec homo = Hto_to_from.trans(to);
@@ -327,13 +412,7 @@ void IncrementalBundleAdjuster::calcJacobianSymbolic(const ParamState& state) {
 			// TODO for the moment, ignore circlic error
 			Vec2D from = p.second + mid_vec_from;
 			if (fabs(from.x - homo.x / homo.z) > ERROR_IGNORE) {
-				REP(i, 6) {
-					J(idx, param_idx_from+i) = 0;
-					J(idx, param_idx_to+i) = 0;
-					J(idx+1, param_idx_from+i) = 0;
-					J(idx+1, param_idx_to+i) = 0;
-				}
-				idx += 2;
+				idx += 2;		// zero rows in J
 				continue;
 			}
 
@@ -379,35 +458,36 @@ void IncrementalBundleAdjuster::calcJacobianSymbolic(const ParamState& state) {
 			dto[5] = drdv((m * dRtodviT[2]).trans(dot_u2));
 #undef drdv
 
-			// fill J
+			// fill Jtr
+			Vec2D res{residual[idx], residual[idx+1]};
 			REP(i, 6) {
-				J(idx, param_idx_from+i) = dfrom[i].x;
-				J(idx, param_idx_to+i) = dto[i].x;
-				J(idx+1, param_idx_from+i) = dfrom[i].y;
-				J(idx+1, param_idx_to+i) = dto[i].y;
+				Jtr(param_idx_from+i) += dfrom[i].dot(res);
+				Jtr(param_idx_to+i) += dto[i].dot(res);
 			}
 
 			// fill JtJ
-			REP(i, 6) REP(j, 6) {
-				int i1 = param_idx_from + i,
-						i2 = param_idx_to + j;
-				auto val = dfrom[i].dot(dto[j]);
-				JtJ(i1, i2) += val, JtJ(i2, i1) += val;
-			}
+			REP(i, 6) REP(j, 6)
+				ft(i, j) += dfrom[i].dot(dto[j]);
 			REP(i, 6) REPL(j, i, 6) {
-				int i1 = param_idx_from + i,
-						i2 = param_idx_from + j;
-				auto val = dfrom[i].dot(dfrom[j]);
-				JtJ(i1, i2) += val;
-				if (i != j) JtJ(i2, i1) += val;
-
-				i1 = param_idx_to + i, i2 = param_idx_to + j;
-				val = dto[i].dot(dto[j]);
-				JtJ(i1, i2) += val;
-				if (i != j) JtJ(i2, i1) += val;
+				ff(i, j) += dfrom[i].dot(dfrom[j]);
+				tt(i, j) += dto[i].dot(dto[j]);
 			}
 			idx += 2;
 		}
+		REP(i, 6) REP(j, i) {
+			ff(i, j) = ff(j, i);
+			tt(i, j) = tt(j, i);
+		}
+		if (sparse) {
+			JtJ_diag[from] += ff;
+			JtJ_diag[to] += tt;
+			JtJ_pair[pair_idx] = ft;
+		} else {
+			JtJ.block<6, 6>(param_idx_from, param_idx_from) += ff;
+			JtJ.block<6, 6>(param_idx_to, param_idx_to) += tt;
+			JtJ.block<6, 6>(param_idx_from, param_idx_to) += ft;
+			JtJ.block<6, 6>(param_idx_to, param_idx_from) += ft.transpose();
+		}
 	}
 }
 
@@ -8,6 +8,7 @@
 #include <vector>
 #include <set>
 #include <Eigen/Dense>
+#include <Eigen/StdVector>
 
 #include "lib/mat.h"
 #include "lib/utils.hh"
@@ -40,7 +41,17 @@ class IncrementalBundleAdjuster {
 
 		void add_match(int i, int j, MatchInfo& m);
 
-		void optimize();
+		// keep the camera of image i unchanged during optimization
+		void fix_camera(int i) { idx_fixed.insert(i); }
+
+		// solve each step as a block-sparse system, with a block per camera and per matched pair,
+		// instead of a dense one whose cost is cubic in the number of cameras.
+		// for many cameras with few matches each
+		void use_sparse_solver() { sparse = true; }
+
+		static const int LM_MAX_ITER = 100;
+
+		void optimize(int max_iter = LM_MAX_ITER);
 
 		ErrorStats get_error_stat() {
 			ParamState state;
@@ -67,6 +78,9 @@ class IncrementalBundleAdjuster {
 		// original indices that have appeared so far
 		std::set<int> idx_added;
 
+		// original indices whose cameras are not optimized
+		std::set<int> idx_fixed;
+
 		// map from original image index to index added
 		std::vector<int> index_map;
 		// map from index in match_pairs to the index of its first error term
@@ -103,15 +117,26 @@ class IncrementalBundleAdjuster {
 
 		/// Optimization routines:
 		Eigen::MatrixXd J, JtJ;		// to avoid too many malloc
+		Eigen::VectorXd Jtr;		// J^T * residual
+
+		bool sparse = false;
+		// blocks of JtJ with the sparse solver: of each camera with itself,
+		// and of the two cameras of each item in match_pairs
+		typedef Eigen::Matrix<double, 6, 6> JtJBlock;
+		std::vector<JtJBlock, Eigen::aligned_allocator<JtJBlock>> JtJ_diag, JtJ_pair;
 
 		ErrorStats calcError(const ParamState& state);
 
 		Eigen::VectorXd get_param_update(
 				const ParamState& state, const std::vector<double>& residual, float);
 
-		// calculate J & JtJ
-		void calcJacobianNumerical(const ParamState& state);
-		void calcJacobianSymbolic(const ParamState& state);
+		// calculate J, JtJ & Jtr
+		void calcJacobianNumerical(const ParamState& state, const std::vector<double>& residual);
+		// calculate JtJ (or its blocks) & Jtr, without forming J, which has rows for every matched point
+		void calcJacobianSymbolic(const ParamState& state, const std::vector<double>& residual);
+
+		// solve the update from the blocks of JtJ
+		Eigen::VectorXd solve_sparse(float lambda);
 
 };
 
@@ -0,0 +1,83 @@
+//File: match_graph.hh
+
+#pragma once
+#include <vector>
+#include <algorithm>
+
+#include "lib/debugutils.hh"
+#include "match_info.hh"
+
+namespace pano {
+
+// Sparse graph of pairwise matches, as adjacency lists.
+// Only the pairs that are matched are stored, so iterating over
+// the edges of an image costs its degree, instead of the number of images.
+// get(i, j)->homo transform j to i
+class MatchGraph {
+	public:
+		struct Edge {
+			int to;
+			MatchInfo info;
+			Edge(int to, MatchInfo&& info): to(to), info(std::move(info)) {}
+		};
+
+		MatchGraph() = default;
+
+		explicit MatchGraph(int n): adj(n) {}
+
+		int size() const { return adj.size(); }
+
+		// keep the existing edges
+		void resize(int n) { adj.resize(n); }
+
+		void clear() { adj.clear(); adj.shrink_to_fit(); }
+
+		// edges from i, sorted by the other end
+		std::vector<Edge>& edges(int i) { return adj[i]; }
+		const std::vector<Edge>& edges(int i) const { return adj[i]; }
+
+		// return nullptr if i and j are not matched
+		MatchInfo* get(int i, int j) {
+			auto itr = find(i, j);
+			return (itr == adj[i].end() || itr->to != j) ? nullptr : &itr->info;
+		}
+		const MatchInfo* get(int i, int j) const {
+			return const_cast<MatchGraph*>(this)->get(i, j);
+		}
+
+		// the match between i and j, which has to exist
+		MatchInfo& at(int i, int j) {
+			auto ret = get(i, j);
+			m_assert(ret != nullptr);
+			return *ret;
+		}
+		const MatchInfo& at(int i, int j) const {
+			return const_cast<MatchGraph*>(this)->at(i, j);
+		}
+
+		// add or replace the match from j to i. not thread-safe
+		void set(int i, int j, MatchInfo info) {
+			auto itr = find(i, j);
+			if (itr != adj[i].end() && itr->to == j)
+				itr->info = std::move(info);
+			else
+				adj[i].emplace(itr, j, std::move(info));
+		}
+
+		// number of directed edges
+		int nr_edges() const {
+			int ret = 0;
+			for (auto& e : adj) ret += e.size();
+			return ret;
+		}
+
+	private:
+		std::vector<std::vector<Edge>> adj;
+
+		std::vector<Edge>::iterator find(int i, int j) {
+			return std::lower_bound(adj[i].begin(), adj[i].end(), j,
+					[](const Edge& e, int j) { return e.to < j; });
+		}
+};
+
+}
@@ -6,6 +6,7 @@
 #include <iostream>
 
 #include "lib/geometry.hh"
+#include "lib/serialize.hh"
 #include "homography.hh"
 
 namespace pano {
@@ -22,29 +23,18 @@ struct MatchInfo {
 			std::swap(c.first, c.second);
 	}
 
+	// binary serialization, used by checkpoints
 	void serialize(std::ostream& os) const {
-		os << confidence << " ";
-		homo.serialize(os);
-		os << " " << match.size();
-		for (auto& p : match) {
-			os << " " << p.first.x << " "
-				<< p.first.y << " " << p.second.x << " "
-				<< p.second.y;
-		}
+		write_pod(os, confidence);
+		write_pod(os, homo.data);
+		write_vec(os, match);
 	}
 
 	static MatchInfo deserialize(std::istream& is) {
 		MatchInfo ret;
-		is >> ret.confidence;
-		ret.homo = Homography::deserialize(is);
-		int match_size;
-		is >> match_size;
-
-		ret.match.resize(match_size);
-		REP(i, match_size) {
-			PCC& p = ret.match[i];
-			is >> p.first.x >> p.first.y >> p.second.x >> p.second.y;
-		}
+		read_pod(is, ret.confidence);
+		read_pod(is, ret.homo.data);
+		read_vec(is, ret.match);
 		return ret;
 	}
 };
@@ -2,67 +2,254 @@
 //Author: Yuxin Wu <ppwwyyxx@gmail.com>
 
 #include "multiband.hh"
+
+#include <algorithm>
 #include "lib/imgproc.hh"
+#include "lib/sampler.hh"
+#include "lib/config.hh"
+#include "lib/prefetcher.hh"
 #include "feature/gaussian.hh"
 
 using namespace std;
+using namespace config;
+
+namespace {
+// blur from each level to the next
+float level_sigma(int level) {
+	return sqrt(level * 2 + 1.0) * 4;	// TODO size
+}
+
+// spacing of the label samples which weight a level, for the weights to be as smooth as
+// the label map blurred by the (truncated) kernels of all previous levels
+int label_stride(int level) {
+	double var = 0;
+	REP(l, level) {
+		pano::GaussCache g(level_sigma(l));
+		for (int k = -g.kw / 2; k <= g.kw / 2; k ++)
+			var += k * k * g.kernel[k];
+	}
+	return max(1, (int)round(sqrt(var) * 2));
+}
+
+// the winner of a pixel always has some weight, even if no label sample around it is valid there
+const float WINNER_WEIGHT = 1e-4f;
+}
+
 namespace pano {
-void MultiBandBlender::add_image(
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::add_image(
 			const Coor& upper_left,
 			const Coor& bottom_right,
 			ImageRef &img,
-			std::function<Vec2D(Coor)> coor_func) {
-	images_to_add.emplace_back(ImageToAdd{Range{upper_left, bottom_right}, img, coor_func});
+			std::function<Vec2D(Coor)> coor_func,
+			RowMapper row_func) {
+	images_to_add.emplace_back(ImageToAdd{Range{upper_left, bottom_right}, img, coor_func, row_func});
 	target_size.update_max(bottom_right);
 }
 
-void MultiBandBlender::create_first_level() {
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::create_first_level(Coor w0, Coor w1,
+		const vector<int>& ids, Prefetcher* prefetcher) {
 	GUARDED_FUNC_TIMER;
 
-	int nr_image = images_to_add.size();
-	meta_images.reserve(nr_image);	// we will need reference to this vector element
+	int nr_image = ids.size();
+	if (nr_image >= NO_LABEL)
+		error_exit(ssprintf("MultiBandBlender supports at most %d images!\n", NO_LABEL - 1));
+	window_size = w1 - w0;
+	// image k is at index k, so ties are broken the same for any thread schedule
+	meta_images.resize(nr_image);	// we will need reference to this vector element
+	vector<Mat<Pixel>> cimgs(nr_image);
+	label = Mat<label_t>(window_size.y, window_size.x, 1);
+	std::fill(label.ptr(), label.ptr() + label.pixels(), NO_LABEL);
+	Mat32f label_w(window_size.y, window_size.x, 1);	// weight of the label
+	memset(label_w.ptr(), 0, label_w.pixels() * sizeof(float));
+
 #pragma omp parallel for schedule(dynamic)
 	REP(k, nr_image) {
-		ImageToAdd& img = images_to_add[k];
-		img.imgref.load();
-
-		auto& range = img.range;
-		Mat<WeightedPixel> wimg(range.height(), range.width(), 1);
-		Mask2D mask(range.height(), range.width());
-		REP(i, range.height()) REP(j, range.width()) {
-			Coor target_coor{j + range.min.x, i + range.min.y};
-			Vec2D orig_coor = img.coor_func(target_coor);
-			Color c = interpolate(*img.imgref.img, orig_coor.y, orig_coor.x);
-			if (c.get_min() < 0) {	// Color::NO
-				wimg.at(i, j).w = 0;
-				wimg.at(i, j).c = Color::BLACK;	// -1 will mess up with gaussian blur
-				mask.set(i, j);
-			} else {
-				wimg.at(i, j).c = c;
-				orig_coor.x = orig_coor.x / img.imgref.width() - 0.5;
-				orig_coor.y = orig_coor.y / img.imgref.height() - 0.5;
-				wimg.at(i, j).w = std::max(0.0,
-						(0.5f - fabs(orig_coor.x)) * (0.5f - fabs(orig_coor.y))) + EPS;
-				// ext? eps?
+		ImageToAdd& img = images_to_add[ids[k]];
+		if (prefetcher)
+			prefetcher->wait(k);
+
+		// the part within the window, on the window
+		Range range = img.range;
+		range.min.update_max(w0);
+		range.max.update_min(w1 - Coor(1, 1));
+		range.min = range.min - w0, range.max = range.max - w0;
+		m_assert(range.min.x <= range.max.x && range.min.y <= range.max.y);
+		Mat<Pixel> cimg(range.height(), range.width(), 1);
+		Mat32f wimg(range.height(), range.width(), 1);
+		MetaImage meta{range, {0}, {}};
+		int n = range.width();
+		vector<float> rs(n), cs(n), colors(n * 3);
+		vector<unsigned char> valid(n);
+		REP(i, range.height()) {
+			img.map_row(i + range.min.y + w0.y, range.min.x + w0.x, range.max.x + w0.x,
+					rs.data(), cs.data());
+			sample_row(*img.imgref.img, rs.data(), cs.data(), n,
+					colors.data(), valid.data(), config_interpolation());
+			REP(j, n) {
+				if (! valid[j]) {	// Color::NO
+					wimg.at(i, j) = 0;
+					cimg.at(i, j) = Pixel(Color::BLACK);	// -1 will mess up with gaussian blur
+				} else {
+					cimg.at(i, j) = Pixel(Color(&colors[j * 3]));
+					double cx = cs[j] / img.imgref.width() - 0.5,
+								 cy = rs[j] / img.imgref.height() - 0.5;
+					wimg.at(i, j) = std::max(0.0,
+							(0.5f - fabs(cx)) * (0.5f - fabs(cy))) + EPS;
+					// ext? eps?
+					int x = j + range.min.x;
+					if (j && wimg.at(i, j - 1) > 0)
+						meta.runs.back().second = x;
+					else
+						meta.runs.emplace_back(x, x);
+				}
 			}
+			meta.row_begin.emplace_back(meta.runs.size());
+		}
+		if (prefetcher) {
+			img.imgref.release();
+			prefetcher->done(k);
 		}
-		img.imgref.release();
+		meta_images[k] = move(meta);
+		cimgs[k] = move(cimg);
 #pragma omp critical
 		{
-			meta_images.emplace_back(MetaImage{range, move(mask)});
-			images.emplace_back(ImageToBlend{move(wimg), meta_images.back()});
+			label_t id = k;
+			// the image with the largest weight wins, the first one on ties
+			int cmax = min(range.max.x, window_size.x - 1);
+			REPL(i, range.min.y, range.max.y + 1) {
+				const float* wrow = wimg.ptr(i - range.min.y) - range.min.x;
+				float* lwrow = label_w.ptr(i);
+				label_t* lrow = label.ptr(i);
+				REPL(j, range.min.x, cmax + 1)
+					if (wrow[j] > lwrow[j] ||
+							(wrow[j] > 0 && wrow[j] == lwrow[j] && id < lrow[j])) {
+						lwrow[j] = wrow[j];
+						lrow[j] = id;
+					}
+			}
 		}
 	}
+	REP(k, nr_image)
+		images.emplace_back(ImageToBlend{move(cimgs[k]), meta_images[k]});
+}
+
+template <typename Pixel>
+Mat32f MultiBandBlenderT<Pixel>::run() {
+	int n = images_to_add.size();
+	Prefetcher prefetcher(n, [&](int k) {
+		images_to_add[k].imgref.load();
+		return images_to_add[k].imgref.nr_bytes();
+	}, (size_t)PREFETCH_MEMORY << 20, PREFETCH_NR_THREAD);
+	vector<int> ids(n);
+	REP(k, n) ids[k] = k;
+	Mat32f target = blend_window(Coor(0, 0), target_size, ids, &prefetcher);
 	images_to_add.clear();
+	return target;
+}
+
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::run_strips(StripWriter& out) {
+	m_assert(out.width() == target_size.x && out.height() == target_size.y);
+	// pixels around a tile which reach it through the pyramid
+	int halo = 0;
+	REP(level, band_level - 1)
+		halo += GaussCache(level_sigma(level)).kw / 2;
+	// and the label samples around it, with the pixels they are made of
+	update_max(halo, label_stride(band_level - 1) * 3 / 2 + 1);
+	// tiles are larger than the halo, so it doesn't dominate
+	int strip_rows = max({1, STREAM_STRIP_PIXELS / target_size.x, halo * 2}),
+			tile_cols = max(STREAM_TILE_COLS, halo * 2);
+	int n = images_to_add.size();
+	Mat32f strip;
+	for (int y0 = 0; y0 < target_size.y; y0 += strip_rows) {
+		int y1 = min(y0 + strip_rows, target_size.y);
+		int wy0 = max(y0 - halo, 0), wy1 = min(y1 + halo, target_size.y);
+		// images reaching the strip, in the order they are first needed by its tiles.
+		// they are loaded again for each strip, so the loads of two strips never overlap
+		vector<int> order;
+		REP(k, n) {
+			auto& range = images_to_add[k].range;
+			if (range.min.y < wy1 && range.max.y >= wy0)
+				order.emplace_back(k);
+		}
+		stable_sort(order.begin(), order.end(), [&](int a, int b) {
+			return images_to_add[a].range.min.x < images_to_add[b].range.min.x;
+		});
+		int m = order.size();
+		Prefetcher prefetcher(m, [&](int k) {
+			auto& ref = images_to_add[order[k]].imgref;
+			ref.load();
+			return ref.nr_bytes();
+		}, (size_t)PREFETCH_MEMORY << 20, PREFETCH_NR_THREAD);
+
+		if (strip.rows() != y1 - y0)
+			strip = Mat32f(y1 - y0, target_size.x, 3);
+		vector<int> active;		// positions in order, of the loaded images
+		int next = 0;
+		for (int x0 = 0; x0 < target_size.x; x0 += tile_cols) {
+			int x1 = min(x0 + tile_cols, target_size.x);
+			int wx0 = max(x0 - halo, 0), wx1 = min(x1 + halo, target_size.x);
+			while (next < m && images_to_add[order[next]].range.min.x < wx1) {
+				prefetcher.wait(next);
+				active.emplace_back(next++);
+			}
+			// blend in the same order as run()
+			vector<int> ids;
+			for (int k : active) ids.emplace_back(order[k]);
+			sort(ids.begin(), ids.end());
+
+			Mat32f tile = blend_window(Coor(wx0, wy0), Coor(wx1, wy1), ids, nullptr);
+			REPL(i, y0, y1)
+				memcpy(strip.ptr(i - y0, x0), tile.ptr(i - wy0, x0 - wx0),
+						(x1 - x0) * 3 * sizeof(float));
+
+			// images left of the window of the next tile are not needed by this strip any more
+			active.erase(remove_if(active.begin(), active.end(), [&](int k) {
+				auto& img = images_to_add[order[k]];
+				if (img.range.max.x >= x1 - halo)
+					return false;
+				img.imgref.release();
+				prefetcher.done(k);
+				return true;
+			}), active.end());
+		}
+		// the ones reaching the right end
+		while (next < m) {
+			prefetcher.wait(next);
+			active.emplace_back(next++);
+		}
+		for (int k : active) {
+			images_to_add[order[k]].imgref.release();
+			prefetcher.done(k);
+		}
+		out.write(strip);
+	}
 }
 
-Mat32f MultiBandBlender::run() {
-	create_first_level();
-	update_weight_map();
-	Mat32f target(target_size.y, target_size.x, 3);
+template <typename Pixel>
+Mat32f MultiBandBlenderT<Pixel>::blend_window(Coor w0, Coor w1,
+		const vector<int>& ids, Prefetcher* prefetcher) {
+	create_first_level(w0, w1, ids, prefetcher);
+	update_coverage();
+	create_label_grids(w0);
+	Mat32f target(window_size.y, window_size.x, 3);
 	fill(target, Color::NO);
 
-	Mask2D target_mask(target_size.y, target_size.x);
+	Mask2D target_mask(window_size.y, window_size.x);
+
+	// where only one image is present, its pyramid collapses back to its first level
+#pragma omp parallel for schedule(dynamic)
+	REP(i, window_size.y) for (auto& s : coverage[i]) {
+		if (s.ids.size() != 1) continue;
+		auto& img = images[s.ids[0]];
+		for (int j = s.l; j <= s.r; j ++) {
+			if (not img.valid_on_target(j, i)) continue;
+			widen(img.color_on_target(j, i)).write_to(target.ptr(i, j));
+			target_mask.set(i, j);
+		}
+	}
 
 	for (auto& m : images)
 		next_lvl_images.emplace_back(m);
@@ -73,22 +260,35 @@ Mat32f MultiBandBlender::run() {
 			create_next_level(level);
 		//debug_level(level);
 #pragma omp parallel for schedule(dynamic)
-		REP(i, target_size.y) REP(j, target_size.x) {
+		REP(i, window_size.y) for (auto& s : coverage[i]) if (s.ids.size() > 1)
+		for (int j = s.l; j <= s.r; j ++) {
+			const LabelSample* samples[4] = {};
+			float coefs[4] = {};
+			if (level)
+				label_grids[level].around(j, i, samples, coefs);
+			label_t winner = label.at(i, j);
 			Color isum(0, 0, 0);
 			float wsum = 0;
-			REP(imgid, images.size())  {
+			for (int imgid : s.ids) {
 				auto& img_cur = images[imgid];
-				if (not img_cur.meta.range.contain(i, j)) continue;
 				if (not img_cur.valid_on_target(j, i)) continue;
 
-				float w = img_cur.weight_on_target(j, i);
+				float w;
+				if (level == 0)
+					w = imgid == winner;
+				else {
+					w = imgid == winner ? WINNER_WEIGHT : 0;
+					REP(c, 4) REP(t, LabelSample::N)
+						if (samples[c]->label[t] == imgid)
+							w += coefs[c] * samples[c]->share[t];
+				}
 				if (w <= 0) continue;
 
-				auto& ccur = img_cur.color_on_target(j, i);
+				const Color& ccur = widen(img_cur.color_on_target(j, i));
 
 				if (not is_last) {
 					auto & img_next = next_lvl_images[imgid];
-					auto& cnext = img_next.color_on_target(j, i);
+					const Color& cnext = widen(img_next.color_on_target(j, i));
 					isum += (ccur - cnext) * w;
 				} else {
 					isum += ccur * w;
@@ -108,7 +308,9 @@ Mat32f MultiBandBlender::run() {
 		}
 		swap(next_lvl_images, images);
 	}
-	images.clear(); next_lvl_images.clear();
+	images.clear(); next_lvl_images.clear(); meta_images.clear();
+	coverage.clear(); label_grids.clear();
+	label = Mat<label_t>();
 
 	REP(i, target.rows()) REP(j, target.cols()) {
 		if (target_mask.get(i, j)) {
@@ -122,33 +324,84 @@ Mat32f MultiBandBlender::run() {
 	return target;
 }
 
-void MultiBandBlender::update_weight_map() {
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::update_coverage() {
 	GUARDED_FUNC_TIMER;
+	vector<const Range*> ranges;
+	for (auto& img : images) ranges.emplace_back(&img.meta.range);
+	coverage.resize(window_size.y);
 #pragma omp parallel for schedule(dynamic, 100)
-	REP(i, target_size.y) REP(j, target_size.x) {
-		float max = 0.f;
-		float* maxp = nullptr;
-		for (auto& img : images) {
-			if (img.meta.range.contain(i, j)) {
-				float& w = img.weight_on_target(j, i);
-				if (w > max) {
-					max = w;
-					maxp = &w;
-				}
-				w = 0;
-			}
-		}
-		if (maxp) *maxp = 1;
-	}
+	REP(i, window_size.y)
+		coverage[i] = coverage_of_row(i, window_size.x, ranges);
 }
 
-void MultiBandBlender::create_next_level(int level) {
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::create_next_level(int level) {
 	TOTAL_FUNC_TIMER;
-	GaussianBlur blurer(sqrt(level * 2 + 1.0) * 4);	// TODO size
+	GaussianBlur blurer(level_sigma(level));
 #pragma omp parallel for schedule(dynamic)
 	REP(i, images.size())
 		next_lvl_images[i].img = blurer.blur(images[i].img);
 }
 
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::create_label_grids(Coor w0) {
+	GUARDED_FUNC_TIMER;
+	label_grids.resize(band_level);
+	REPL(level, 1, band_level) {
+		auto& g = label_grids[level];
+		int s = g.stride = label_stride(level);
+		// samples are at multiples of stride on target, to be the same for any window
+		g.offset = Coor(w0.x % s, w0.y % s);
+		g.grid = Mat<LabelSample>((window_size.y - 1 + g.offset.y) / s + 2,
+				(window_size.x - 1 + g.offset.x) / s + 2, 1);
+		// pixels of the window around the sample at grid i: [lo(i), lo(i) + s)
+		auto lo = [s](int i, int offset) { return i * s - s / 2 - offset; };
+#pragma omp parallel for schedule(dynamic)
+		REP(i, g.grid.rows()) {
+			int y0 = max(lo(i, g.offset.y), 0), y1 = min(lo(i, g.offset.y) + s, window_size.y);
+			vector<pair<int, label_t>> count;		// of each label
+			REP(j, g.grid.cols()) {
+				int x0 = max(lo(j, g.offset.x), 0), x1 = min(lo(j, g.offset.x) + s, window_size.x);
+				count.clear();
+				REPL(y, y0, y1) REPL(x, x0, x1) {
+					label_t l = label.at(y, x);
+					if (l == NO_LABEL) continue;
+					auto it = find_if(count.begin(), count.end(),
+							[l](const pair<int, label_t>& c) { return c.second == l; });
+					if (it == count.end())
+						count.emplace_back(1, l);
+					else
+						it->first ++;
+				}
+				sort(count.rbegin(), count.rend());
+				auto& sample = g.grid.at(i, j);
+				REP(t, LabelSample::N) {
+					bool has = t < (int)count.size();
+					sample.label[t] = has ? count[t].second : NO_LABEL;
+					sample.share[t] = has ? (float)count[t].first / (s * s) : 0;
+				}
+			}
+		}
+	}
+}
+
+template <typename Pixel>
+void MultiBandBlenderT<Pixel>::LabelGrid::around(
+		int x, int y, const LabelSample** samples, float* coefs) const {
+	x += offset.x, y += offset.y;
+	int gx = x / stride, gy = y / stride;
+	float fx = (float)(x - gx * stride) / stride,
+				fy = (float)(y - gy * stride) / stride;
+	const LabelSample* row = grid.ptr(gy, gx);
+	samples[0] = row, samples[1] = row + 1;
+	row += grid.cols();
+	samples[2] = row, samples[3] = row + 1;
+	coefs[0] = (1 - fx) * (1 - fy), coefs[1] = fx * (1 - fy);
+	coefs[2] = (1 - fx) * fy, coefs[3] = fx * fy;
+}
+
+template class MultiBandBlenderT<Color>;
+template class MultiBandBlenderT<HalfColor>;
 
 }	// namespace pano
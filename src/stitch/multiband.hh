@@ -3,24 +3,20 @@
 
 #pragma once
 
+#include <cstdint>
 #include "blender.hh"
 #include "lib/matrix.hh"
+#include "lib/half.hh"
 
 namespace pano {
 
-class MultiBandBlender : public BlenderBase {
-	struct WeightedPixel {
-		Color c;
-		float w;
-
-		WeightedPixel() {}
-		WeightedPixel(float v): c(v,v,v), w(v) {}
-		WeightedPixel(float w, const Color& c): c(c), w(w) {}
-
-		WeightedPixel operator * (float v) const { return WeightedPixel{w * v, c * v}; }
-		void operator += (const WeightedPixel& p) { w += p.w; c += p.c; }
-	};
+class Prefetcher;
 
+// Pixel is the type to store colors of the pyramid levels in,
+// e.g. Color, or HalfColor to take half the memory.
+// It is converted to Color by widen() to compute.
+template <typename Pixel>
+class MultiBandBlenderT : public BlenderBase {
 	struct Mask2D {
 		bool get(int i, int j) const { return mask[i * w + j]; }
 		void set(int i, int j) { mask[i * w + j] = true; }
@@ -35,60 +31,110 @@ class MultiBandBlender : public BlenderBase {
 
 	struct MetaImage {
 		Range range;		// a RoI in target image, starting from range.min
-		Mask2D mask;		// 1: invalid
+
+		// valid pixels, as runs [l, r] on target.
+		// runs[row_begin[i]] ~ runs[row_begin[i+1]-1] are on row i of the RoI
+		std::vector<int> row_begin;
+		std::vector<std::pair<int, int>> runs;
+
+		bool valid(int x, int y) const {
+			y -= range.min.y;
+			for (int k = row_begin[y]; k < row_begin[y + 1]; k ++)
+				if (x >= runs[k].first && x <= runs[k].second)
+					return true;
+			return false;
+		}
 	};
 
 	struct ImageToBlend {
-		Mat<WeightedPixel> img;
+		Mat<Pixel> img;
 		const MetaImage& meta;
 
-		float weight_on_target(int x, int y) const {
-			return img.at(y - meta.range.min.y, x - meta.range.min.x).w;
-		}
-
-		float& weight_on_target(int x, int y) {
+		const Pixel& color_on_target(int x, int y) const {
 			// x, y: coordinate on target
-			return img.at(y - meta.range.min.y, x - meta.range.min.x).w;
+			return img.at(y - meta.range.min.y, x - meta.range.min.x);
 		}
 
-		const Color& color_on_target(int x, int y) const {
-			return img.at(y - meta.range.min.y, x - meta.range.min.x).c;
-		}
+		bool valid_on_target(int x, int y) const { return meta.valid(x, y); }
+	};
 
-		bool valid_on_target(int x, int y) const {
-			x -= meta.range.min.x, y -= meta.range.min.y;
-			return not meta.mask.get(y, x);
-		}
+	// the image which wins each pixel of the window. Only its weight is 1 on the first level
+	typedef uint16_t label_t;
+	static const label_t NO_LABEL = 0xffff;
+	Mat<label_t> label;
 
+	// the images winning the pixels around a sample of the label map, by their shares
+	struct LabelSample {
+		static const int N = 3;		// the others are dropped
+		label_t label[N];
+		float share[N];
 	};
+	// label map sampled every stride pixels of target, to weight the images on a level.
+	// a sample has the shares of the stride x stride pixels around it, and the weight of an image
+	// is the bilinear interpolation of its shares. It's as smooth as a gaussian of sigma stride/2
+	struct LabelGrid {
+		int stride;
+		Coor offset;		// of the window from the first sample
+		Mat<LabelSample> grid;
+
+		// the 4 samples around a pixel of the window, and their coefficients
+		void around(int x, int y, const LabelSample** samples, float* coefs) const;
+	};
+	std::vector<LabelGrid> label_grids;	// of each level but the first, which uses the label map
 
 	std::vector<ImageToAdd> images_to_add;
 	std::vector<MetaImage> meta_images;
 	std::vector<ImageToBlend> images;
 	std::vector<ImageToBlend> next_lvl_images;
-
-	void create_first_level();
-	void update_weight_map();
-	// build next level weights from images to next_lvl_images
+	// spans of each target row, by the images covering them
+	std::vector<std::vector<Span>> coverage;
+
+	// sample images_to_add[ids] on the window [w0, w1) of target, as the first level
+	// of images on the window, and fill the label map. they all have to reach the window.
+	// if prefetcher is given, ids[k] is its k-th item, and released once sampled.
+	// otherwise they are loaded already
+	void create_first_level(Coor w0, Coor w1,
+			const std::vector<int>& ids, Prefetcher* prefetcher);
+	// blend the window [w0, w1) of target. see create_first_level
+	Mat32f blend_window(Coor w0, Coor w1,
+			const std::vector<int>& ids, Prefetcher* prefetcher);
+	void update_coverage();
+	// build next level colors from images to next_lvl_images
 	void create_next_level(int level);
-	// save image and weight from next_lvl_images
+	// sample the label map of the window [w0, w1) for each level
+	void create_label_grids(Coor w0);
+	// save image and weight from images
 	void debug_level(int level) const;
 
 
 	Coor target_size{0, 0};
+	Coor window_size{0, 0};		// of the window being blended
 	int band_level;
 
 	public:
-	MultiBandBlender(int band_level):
+	MultiBandBlenderT(int band_level):
 		band_level(band_level) {} // default: 5?
 
+	// the target is at least of this size
+	MultiBandBlenderT(int band_level, Coor target_size):
+		target_size(target_size), band_level(band_level) {}
+
 	void add_image(
 			const Coor& upper_left,
 			const Coor& bottom_right,
 			ImageRef &img,
-			std::function<Vec2D(Coor)>) override;
+			std::function<Vec2D(Coor)>,
+			RowMapper row_func = nullptr) override;
 
 	Mat32f run() override;
+
+	// blend each strip of rows by tiles of columns, each with a halo as large as the pyramid reaches.
+	// an image is loaded for the first tile of a strip it reaches, and released after the last one
+	void run_strips(StripWriter& out) override;
 };
 
+typedef MultiBandBlenderT<Color> MultiBandBlender;
+// pyramid levels in half precision
+typedef MultiBandBlenderT<HalfColor> HalfMultiBandBlender;
+
 }	// namespace pano
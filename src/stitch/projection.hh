@@ -42,4 +42,20 @@ namespace pano {
 			return Vec(sin(coord.x), tan(coord.y), cos(coord.x));
 		}
 	}
+
+	// the projections as types, for loops templated on them to have the projection inlined
+	struct FlatProjection {
+		static Vec2D homo2proj(const Vec& coord) { return flat::homo2proj(coord); }
+		static Vec proj2homo(const Vec2D& coord) { return flat::proj2homo(coord); }
+	};
+
+	struct CylindricalProjection {
+		static Vec2D homo2proj(const Vec& coord) { return cylindrical::homo2proj(coord); }
+		static Vec proj2homo(const Vec2D& coord) { return cylindrical::proj2homo(coord); }
+	};
+
+	struct SphericalProjection {
+		static Vec2D homo2proj(const Vec& coord) { return spherical::homo2proj(coord); }
+		static Vec proj2homo(const Vec2D& coord) { return spherical::proj2homo(coord); }
+	};
 }
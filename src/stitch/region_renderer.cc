@@ -0,0 +1,102 @@
+//File: region_renderer.cc
+
+#include "region_renderer.hh"
+
+#include <cmath>
+#include "lib/imgproc.hh"
+#include "lib/utils.hh"
+#include "blender.hh"
+using namespace std;
+
+namespace {
+// don't use mips smaller than this
+const int MIN_MIP_SIZE = 16;
+}
+
+namespace pano {
+
+RegionRenderer::RegionRenderer(const ConnectedImages& bundle):
+	bundle(bundle), resolution(bundle.get_final_resolution()) {
+	Vec2D size_d = bundle.proj_range.size() / resolution;
+	full_size = Coor(size_d.x, size_d.y);
+}
+
+int RegionRenderer::choose_level(int idx, double ratio) const {
+	auto& ref = *bundle.component[idx].imgptr;
+	int min_edge = min(ref.width(), ref.height()), level = 0;
+	while (ratio >= 2 && (min_edge >> (level + 1)) >= MIN_MIP_SIZE) {
+		ratio /= 2;
+		level ++;
+	}
+	return level;
+}
+
+Mat32f RegionRenderer::render(
+		const Vec2D& top_left, const Vec2D& bottom_right, double scale) {
+	m_assert(scale > 0);
+	Vec2D out_d = (bottom_right - top_left) * scale;
+	Coor out_size(ceil(out_d.x), ceil(out_d.y));
+	m_assert(out_size.x > 0 && out_size.y > 0);
+
+	// projection coordinate of output pixel t is t * unit + origin,
+	// which aligns pixel centers of the output and the full result
+	double shift = 0.5 / scale - 0.5;
+	Vec2D unit = resolution / scale,
+				origin = (top_left + Vec2D(shift, shift)) * resolution + bundle.proj_range.min;
+	auto proj2homo = bundle.get_proj2homo();
+
+	LinearBlender blender(out_size);
+	decltype(mips) used;
+	REP(i, (int)bundle.component.size()) {
+		auto& cur = bundle.component[i];
+		// footprint on the output
+		Vec2D fmin = (cur.range.min - origin) / unit,
+					fmax = (cur.range.max - origin) / unit;
+		if (fmax.x < 0 || fmax.y < 0 || fmin.x >= out_size.x || fmin.y >= out_size.y)
+			continue;
+
+		auto& ref = *cur.imgptr;
+		// source pixels per output pixel, from the local jacobian of the mapping
+		// at the center of the visible footprint
+		auto to_source = [&](Vec2D t) { return cur.homo_to_image(proj2homo(t * unit + origin)); };
+		Vec2D center((max(fmin.x, 0.) + min(fmax.x, out_size.x - 1.)) * 0.5,
+				(max(fmin.y, 0.) + min(fmax.y, out_size.y - 1.)) * 0.5);
+		Vec2D p = to_source(center),
+					dx = to_source(center + Vec2D(1, 0)) - p,
+					dy = to_source(center + Vec2D(0, 1)) - p;
+		double ratio = min(hypot(dx.x, dx.y), hypot(dy.x, dy.y));
+		if (p.x < 0 || std::isnan(ratio))		// behind the camera, use the footprint instead
+			ratio = min(ref.width() / (fmax.x - fmin.x),
+					ref.height() / (fmax.y - fmin.y));
+		auto key = make_pair(i, choose_level(i, ratio));
+		auto itr = mips.find(key);
+		if (itr != mips.end())
+			used[key] = move(itr->second);
+		else {
+			unique_ptr<ImageRef> mip(new ImageRef(ref.fname));
+			mip->img = new Matuc(read_img_uc(ref.fname.c_str(), key.second));
+			mip->_width = mip->img->width();
+			mip->_height = mip->img->height();
+			used[key] = move(mip);
+		}
+		ImageRef& mip = *used[key];
+		int level = key.second;
+
+		// from pixel centers of the original image to those of the mip
+		Vec2D mip_scale(mip.width() * 1.0 / ref.width(), mip.height() * 1.0 / ref.height());
+		Coor upper_left(max(fmin.x, 0.), max(fmin.y, 0.)),
+				 bottom_right(min(fmax.x, (double)out_size.x), min(fmax.y, (double)out_size.y));
+		blender.add_image(upper_left, bottom_right, mip,
+				[=,&cur](Coor t) -> Vec2D {
+					Vec2D c = Vec2D(t.x, t.y) * unit + origin;
+					Vec2D p = cur.homo_to_image(proj2homo(c));
+					if (level == 0) return p;
+					return (p + Vec2D(0.5, 0.5)) * mip_scale - Vec2D(0.5, 0.5);
+				});
+	}
+	// keep what's used in this call
+	mips.swap(used);
+	return blender.run_loaded();
+}
+
+}
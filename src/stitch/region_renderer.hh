@@ -0,0 +1,46 @@
+//File: region_renderer.hh
+
+#pragma once
+#include <map>
+#include <memory>
+#include <utility>
+#include "lib/mat.h"
+#include "lib/geometry.hh"
+#include "stitcher_image.hh"
+
+namespace pano {
+
+// Render any rectangle of the result of ConnectedImages::blend(), at any scale,
+// without blending the whole panorama.
+// Only the images whose footprint meets the rectangle are read, each at the
+// mip level (downscaled by 2^k) which still has one pixel per output pixel,
+// measured by the local jacobian of the mapping from output to the image.
+// The mips used by the last call are kept for the next one, for interactive viewing.
+class RegionRenderer {
+	public:
+		// bundle has to outlive the renderer
+		explicit RegionRenderer(const ConnectedImages& bundle);
+
+		RegionRenderer(const RegionRenderer&) = delete;
+		RegionRenderer& operator = (const RegionRenderer&) = delete;
+
+		// shape of the full result
+		Coor size() const { return full_size; }
+
+		// render [top_left, bottom_right) of the full result, scaled by scale.
+		// uncovered pixels are Color::NO
+		Mat32f render(const Vec2D& top_left, const Vec2D& bottom_right, double scale);
+
+	private:
+		const ConnectedImages& bundle;
+		Vec2D resolution;		// projection unit per pixel of the full result
+		Coor full_size;
+
+		// (image index, level) -> the image downscaled by 2^level
+		std::map<std::pair<int, int>, std::unique_ptr<ImageRef>> mips;
+
+		// pick the mip level of image idx, with ratio source pixels per output pixel
+		int choose_level(int idx, double ratio) const;
+};
+
+}
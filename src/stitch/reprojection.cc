@@ -0,0 +1,227 @@
+//File: reprojection.cc
+
+#define _USE_MATH_DEFINES
+#include "reprojection.hh"
+
+#include <cmath>
+#include <algorithm>
+#include "lib/imgproc.hh"
+#include "lib/sampler.hh"
+#include "lib/timer.hh"
+#include "projection.hh"
+#include "blender.hh"
+using namespace std;
+
+namespace {
+// views are rendered by tiles of this size
+const int TILE_SIZE = 64;
+// footprints of images on a view are found by sampling every this many pixels
+const int FOOTPRINT_STEP = 16;
+}
+
+namespace pano {
+
+View::View(Projection proj, Coor size, double hfov,
+		double yaw, double pitch, double roll):
+	proj(proj), shape(size), center((size.x - 1) * 0.5, (size.y - 1) * 0.5) {
+	m_assert(size.x > 0 && size.y > 0 && hfov > 0);
+	double half_w = size.x * 0.5;
+	switch (proj) {
+		case rectilinear:
+			m_assert(hfov < M_PI);
+			unit = tan(hfov / 2) / half_w;
+			break;
+		case stereographic:
+			// radius on the projection plane is 2 tan(theta / 2), for a direction
+			// at angle theta from the view axis
+			m_assert(hfov < 2 * M_PI);
+			unit = 2 * tan(hfov / 4) / half_w;
+			break;
+		case equirectangular:
+		case mercator:
+			unit = hfov / size.x;
+			REP(x, size.x) {
+				double lon = (x - center.x) * unit;
+				sin_lon.emplace_back(sin(lon));
+				cos_lon.emplace_back(cos(lon));
+			}
+			REP(y, size.y) {
+				double lat = (y - center.y) * unit;
+				if (proj == mercator)
+					lat = atan(sinh(lat));
+				sin_lat.emplace_back(sin(lat));
+				cos_lat.emplace_back(cos(lat));
+			}
+			break;
+	}
+
+	double cy = cos(yaw), sy = sin(yaw),
+				 cp = cos(pitch), sp = sin(pitch),
+				 cr = cos(roll), sr = sin(roll);
+	Homography ry{{cy, 0, sy, 0, 1, 0, -sy, 0, cy}},
+						 rx{{1, 0, 0, 0, cp, -sp, 0, sp, cp}},
+						 rz{{cr, -sr, 0, sr, cr, 0, 0, 0, 1}};
+	rot = ry * rx * rz;
+}
+
+void View::row_directions(int y, int x0, int x1, Vec* out) const {
+	double v = (y - center.y) * unit;
+	switch (proj) {
+		case rectilinear:
+			// linear along the row
+			{
+				Vec d = rot.trans(Vec((x0 - center.x) * unit, v, 1)),
+						step = Vec(rot[0], rot[3], rot[6]) * unit;
+				REPL(x, x0, x1) {
+					*(out++) = d;
+					d += step;
+				}
+			}
+			break;
+		case stereographic:
+			// the inverse stereographic projection is rational
+			REPL(x, x0, x1) {
+				double u = (x - center.x) * unit;
+				*(out++) = rot.trans(Vec(4 * u, 4 * v, 4 - u * u - v * v));
+			}
+			break;
+		case equirectangular:
+		case mercator:
+			{
+				double sl = sin_lat[y], cl = cos_lat[y];
+				REPL(x, x0, x1)
+					*(out++) = rot.trans(Vec(cl * sin_lon[x], sl, cl * cos_lon[x]));
+			}
+			break;
+	}
+}
+
+namespace {
+
+// bilinear interpolation on a panorama covering all longitudes,
+// between its last column and the first one
+Color interpolate_seam(const Mat32f& mat, float r, float c) {
+	int w = mat.width(), fc = w - 1;
+	int fr = floor(r);
+	if (fr < 0 || fr + 1 >= mat.height())
+		return Color::NO;
+	float dr = r - fr, dc = c - fc;
+	Color top = Color(mat.ptr(fr, fc)) * (1 - dc) + Color(mat.ptr(fr, 0)) * dc,
+				bottom = Color(mat.ptr(fr + 1, fc)) * (1 - dc) + Color(mat.ptr(fr + 1, 0)) * dc;
+	return top * (1 - dr) + bottom * dr;
+}
+
+}
+
+Mat32f reproject(const Mat32f& pano, double hfov, const View& view) {
+	GUARDED_FUNC_TIMER;
+	Coor size = view.size();
+	Mat32f ret(size.y, size.x, 3);
+	fill(ret, Color::NO);
+	int w = pano.width(), h = pano.height();
+	double unit = hfov / w;
+	bool wrap = hfov > 2 * M_PI - unit;		// covering all longitudes
+
+	int nx = (size.x + TILE_SIZE - 1) / TILE_SIZE,
+			ny = (size.y + TILE_SIZE - 1) / TILE_SIZE;
+#pragma omp parallel for schedule(dynamic)
+	REP(t, nx * ny) {
+		int x0 = t % nx * TILE_SIZE, y0 = t / nx * TILE_SIZE,
+				x1 = min(x0 + TILE_SIZE, size.x), y1 = min(y0 + TILE_SIZE, size.y);
+		int n = x1 - x0;
+		Vec dirs[TILE_SIZE];
+		float rs[TILE_SIZE], cs[TILE_SIZE];
+		unsigned char valid[TILE_SIZE];
+		REPL(y, y0, y1) {
+			view.row_directions(y, x0, x1, dirs);
+			REP(k, n) {
+				Vec2D p = spherical::homo2proj(dirs[k]);
+				cs[k] = p.x / unit + w * 0.5 - 0.5;
+				rs[k] = p.y / unit + h * 0.5 - 0.5;
+				if (wrap) {
+					cs[k] = fmod(cs[k], (float)w);
+					if (cs[k] < 0) cs[k] += w;
+				}
+			}
+			float* row = ret.ptr(y, x0);
+			sample_row(pano, rs, cs, n, row, valid, config_interpolation());
+			if (wrap)
+				REP(k, n)
+					if (! valid[k] && cs[k] >= w - 1)
+						interpolate_seam(pano, rs[k], cs[k]).write_to(row + k * 3);
+		}
+	}
+	return ret;
+}
+
+Mat32f reproject(const ConnectedImages& bundle, const View& view) {
+	GUARDED_FUNC_TIMER;
+	m_assert(bundle.proj_method == ConnectedImages::ProjectionMethod::spherical);
+	auto& comp = bundle.component;
+	int n = comp.size();
+#pragma omp parallel for schedule(dynamic)
+	REP(i, n) comp[i].imgptr->load();
+
+	// footprint of each image on the view, by the samples mapped into it,
+	// extended by a step to cover the pixels between the samples
+	Coor size = view.size();
+	vector<int> xs, ys;
+	for (int x = 0; x < size.x; x += FOOTPRINT_STEP) xs.emplace_back(x);
+	for (int y = 0; y < size.y; y += FOOTPRINT_STEP) ys.emplace_back(y);
+	xs.emplace_back(size.x - 1), ys.emplace_back(size.y - 1);
+	vector<vector<BlenderBase::Range>> row_footprints(ys.size());
+#pragma omp parallel for schedule(dynamic)
+	REP(k, (int)ys.size()) {
+		auto& fp = row_footprints[k];
+		fp.resize(n, BlenderBase::Range{Coor(size.x, size.y), Coor(-1, -1)});
+		vector<Vec> dirs(size.x);
+		view.row_directions(ys[k], 0, size.x, dirs.data());
+		REP(i, n) {
+			auto& ref = *comp[i].imgptr;
+			for (int x : xs) {
+				Vec2D p = comp[i].homo_to_image(dirs[x]);
+				if (p.x < 0 || p.x >= ref.width() || p.y < 0 || p.y >= ref.height())
+					continue;
+				fp[i].min.update_min(Coor(x, ys[k]));
+				fp[i].max.update_max(Coor(x, ys[k]));
+			}
+		}
+	}
+
+	LinearBlender blender(size);
+	REP(i, n) {
+		BlenderBase::Range r{Coor(size.x, size.y), Coor(-1, -1)};
+		for (auto& fp : row_footprints) {
+			r.min.update_min(fp[i].min);
+			r.max.update_max(fp[i].max);
+		}
+		if (r.max.x < 0)
+			continue;		// not in the view
+		r.min = r.min - Coor(FOOTPRINT_STEP, FOOTPRINT_STEP);
+		r.max = r.max + Coor(FOOTPRINT_STEP, FOOTPRINT_STEP);
+		r.min.update_max(Coor(0, 0));
+		r.max.update_min(Coor(size.x - 1, size.y - 1));
+		auto& cur = comp[i];
+		blender.add_image(r.min, r.max, *cur.imgptr,
+				[&view, &cur](Coor t) -> Vec2D {
+					Vec dir;
+					view.direction(t.x, t.y, &dir);
+					return cur.homo_to_image(dir);
+				},
+				[&view, &cur](int i, int l, int r, float* rows, float* cols) {
+					Vec dirs[TILE_SIZE];
+					// by pieces of the row
+					for (int x0 = l; x0 <= r; x0 += TILE_SIZE) {
+						int x1 = min(x0 + TILE_SIZE, r + 1);
+						view.row_directions(i, x0, x1, dirs);
+						REP(k, x1 - x0) {
+							Vec2D p = cur.homo_to_image(dirs[k]);
+							cols[x0 - l + k] = p.x, rows[x0 - l + k] = p.y;
+						}
+					}
+				});
+	}
+	return blender.run_loaded();
+}
+
+}
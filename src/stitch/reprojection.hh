@@ -0,0 +1,57 @@
+//File: reprojection.hh
+
+#pragma once
+#include <vector>
+#include "lib/mat.h"
+#include "lib/geometry.hh"
+#include "homography.hh"
+#include "stitcher_image.hh"
+
+namespace pano {
+
+// A view of the directions around the camera, in some projection and orientation.
+// Directions are in the identity frame of a bundle estimated with cameras:
+// x to the right, y downwards, z forwards.
+class View {
+	public:
+		enum Projection { rectilinear, stereographic, equirectangular, mercator };
+
+		// hfov: horizontal field of view, less than 180 degrees for rectilinear,
+		// and less than 360 degrees for stereographic.
+		// yaw turns right, pitch turns up, and roll turns clockwise around the view axis.
+		// all angles are in radians
+		View(Projection proj, Coor size, double hfov,
+				double yaw = 0, double pitch = 0, double roll = 0);
+
+		Coor size() const { return shape; }
+
+		// directions (not normalized) of pixels [x0, x1) on row y.
+		// no trigonometric function is evaluated per pixel
+		void row_directions(int y, int x0, int x1, Vec* out) const;
+
+		void direction(int x, int y, Vec* out) const
+		{ row_directions(y, x, x + 1, out); }
+
+	private:
+		Projection proj;
+		Coor shape;
+		Homography rot;		// from the view to the identity frame
+		double unit;			// projection unit per pixel
+		Vec2D center;			// pixel on the view axis
+
+		// equirectangular and mercator:
+		// longitude of each column and latitude of each row, by their sin and cos
+		std::vector<double> sin_lon, cos_lon, sin_lat, cos_lat;
+};
+
+// Render a view from a finished panorama in equirectangular projection,
+// whose center is the forward direction and whose pixels are square, spanning
+// hfov horizontally. Uncovered pixels of the view are Color::NO.
+Mat32f reproject(const Mat32f& pano, double hfov, const View& view);
+
+// Render a view from the source images of a bundle estimated with cameras,
+// blended like LinearBlender. Uncovered pixels of the view are Color::NO.
+// The images are loaded and kept, so more views of the bundle are rendered cheaply.
+Mat32f reproject(const ConnectedImages& bundle, const View& view);
+
+}
@@ -5,10 +5,14 @@
 
 #include "stitcher.hh"
 
+#include <algorithm>
 #include <limits>
 #include <string>
 #include <cmath>
 #include <queue>
+#include <set>
+#include <functional>
+#include <omp.h>
 
 #include "feature/matcher.hh"
 #include "lib/imgproc.hh"
@@ -17,6 +21,7 @@
 #include "match_info.hh"
 #include "transform_estimate.hh"
 #include "camera_estimator.hh"
+#include "hierarchical_estimator.hh"
 #include "camera.hh"
 #include "warp.hh"
 using namespace std;
@@ -27,40 +32,94 @@ namespace pano {
 
 // use in development
 const static bool DEBUG_OUT = false;
-const static char* MATCHINFO_DUMP = "log/matchinfo.txt";
 
 Mat32f Stitcher::build() {
-	calc_feature();
-	// TODO choose a better starting point by MST use centrality
+	build_bundle();
+	return bundle.blend();
+}
 
-	pairwise_matches.resize(imgs.size());
-	for (auto& k : pairwise_matches) k.resize(imgs.size());
-	if (ORDERED_INPUT)
-		linear_pairwise_match();
-	else
-		pairwise_match();
-	free_feature();
-	//load_matchinfo(MATCHINFO_DUMP);
-	if (DEBUG_OUT) {
-		draw_matchinfo();
-		dump_matchinfo(MATCHINFO_DUMP);
+void Stitcher::build_bundle() {
+	if (incremental) {
+		build_incremental();
+		print_debug("Using projection method: %d\n", bundle.proj_method);
+		return;
 	}
-	assign_center();
 
-	if (ESTIMATE_CAMERA)
-		estimate_camera();
-	else
-		build_linear_simple();		// naive mode
-	pairwise_matches.clear();
-	// TODO automatically determine projection method
-	if (ESTIMATE_CAMERA)
-		//bundle.proj_method = ConnectedImages::ProjectionMethod::cylindrical;
-		bundle.proj_method = ConnectedImages::ProjectionMethod::spherical;
-	else
-		bundle.proj_method = ConnectedImages::ProjectionMethod::flat;
+	if (resume_stage == CheckpointStage::None || resume_stage == CheckpointStage::Feature) {
+		if (resume_stage == CheckpointStage::Feature) {
+			load_feature_checkpoint(FEATURE_CHECKPOINT, imgs, feats);
+			calc_feature(imgs.size());	// only fill keypoints
+		} else {
+			calc_feature();
+			if (CHECKPOINT)
+				save_feature_checkpoint(FEATURE_CHECKPOINT, imgs, feats);
+		}
+		// TODO choose a better starting point by MST use centrality
+
+		pairwise_matches = MatchGraph(imgs.size());
+		if (ORDERED_INPUT)
+			linear_pairwise_match();
+		else if (GUIDED_MATCHING)
+			guided_pairwise_match();
+		else
+			pairwise_match();
+		free_feature();
+		if (DEBUG_OUT)
+			draw_matchinfo();
+		if (CHECKPOINT)
+			save_match_checkpoint(MATCH_CHECKPOINT, imgs, pairwise_matches);
+	} else if (resume_stage == CheckpointStage::Match)
+		load_match_checkpoint(MATCH_CHECKPOINT, imgs, pairwise_matches);
+
+	if (resume_stage != CheckpointStage::Camera) {
+		assign_center();
+
+		if (ESTIMATE_CAMERA)
+			estimate_camera();
+		else
+			build_linear_simple();		// naive mode
+		pairwise_matches.clear();
+		// TODO automatically determine projection method
+		if (ESTIMATE_CAMERA)
+			//bundle.proj_method = ConnectedImages::ProjectionMethod::cylindrical;
+			bundle.proj_method = ConnectedImages::ProjectionMethod::spherical;
+		else
+			bundle.proj_method = ConnectedImages::ProjectionMethod::flat;
+		bundle.update_proj_range();
+		if (CHECKPOINT)
+			save_camera_checkpoint(CAMERA_CHECKPOINT, imgs, cameras, bundle);
+	} else
+		load_camera_checkpoint(CAMERA_CHECKPOINT, imgs, cameras, bundle);
 	print_debug("Using projection method: %d\n", bundle.proj_method);
+}
+
+void Stitcher::build_incremental() {
+	if (!ESTIMATE_CAMERA)
+		error_exit("Adding images requires ESTIMATE_CAMERA mode!\n");
+	int n = imgs.size();
+	int nr_old = load_camera_checkpoint(CAMERA_CHECKPOINT, imgs, cameras, bundle, true);
+	if ((int)cameras.size() != nr_old)
+		error_exit("The checkpoint has no camera to add images to!\n");
+	if (load_match_checkpoint(MATCH_CHECKPOINT, imgs, pairwise_matches, true) != nr_old ||
+			load_feature_checkpoint(FEATURE_CHECKPOINT, imgs, feats, true) != nr_old)
+		error_exit("The checkpoints are saved from different runs!\n");
+	if (nr_old == n)
+		error_exit("No new images to add!\n");
+	print_debug("Adding %d images to %d existing ones\n", n - nr_old, nr_old);
+
+	calc_feature(nr_old);
+	save_feature_checkpoint(FEATURE_CHECKPOINT, imgs, feats);
+	pairwise_match(nr_old);
+	free_feature();
+	save_match_checkpoint(MATCH_CHECKPOINT, imgs, pairwise_matches);
+
+	vector<Shape2D> shapes;
+	for (auto& m: imgs) shapes.emplace_back(m.shape());
+	cameras = CameraEstimator{pairwise_matches, shapes}.estimate_incremental(cameras);
+	pairwise_matches.clear();
+	camera_to_homo();
 	bundle.update_proj_range();
-	return bundle.blend();
+	save_camera_checkpoint(CAMERA_CHECKPOINT, imgs, cameras, bundle);
 }
 
 bool Stitcher::match_image(
@@ -86,18 +145,22 @@ bool Stitcher::match_image(
 			info.confidence);
 
 	// fill in pairwise matches
-	pairwise_matches[i][j] = info;
-	info.homo = inv;
-	info.reverse();
-	pairwise_matches[j][i] = move(info);
+	MatchInfo rev = info;
+	rev.homo = inv;
+	rev.reverse();
+#pragma omp critical
+	{
+		pairwise_matches.set(i, j, move(info));
+		pairwise_matches.set(j, i, move(rev));
+	}
 	return true;
 }
 
-void Stitcher::pairwise_match() {
+void Stitcher::pairwise_match(int start) {
 	GuardedTimer tm("pairwise_match()");
-	size_t n = imgs.size();
+	int n = imgs.size();
 	vector<pair<int, int>> tasks;
-	REP(i, n) REPL(j, i + 1, n) tasks.emplace_back(i, j);
+	REP(i, n) REPL(j, max(i + 1, start), n) tasks.emplace_back(i, j);
 
 	PairWiseMatcher pwmatcher(feats);
 #pragma omp parallel for schedule(dynamic)
@@ -128,6 +191,121 @@ void Stitcher::linear_pairwise_match() {
 	}
 }
 
+void Stitcher::guided_pairwise_match() {
+	GuardedTimer tm("guided_pairwise_match()");
+	int n = imgs.size();
+	PairWiseMatcher pwmatcher(feats);
+	set<pair<int, int>> tried;		// pairs (i, j), i < j, which have been matched
+
+	// retrieval by matching a few features of each image
+	struct Candidate {
+		int i, j, score;
+		bool operator < (const Candidate& r) const { return score > r.score; }
+	};
+	vector<Candidate> candidates;
+	{
+		GuardedTimer tm("retrieval");
+		if (n - 1 <= RETRIEVAL_NR_CANDIDATE) {
+			REP(i, n) REPL(j, i + 1, n) candidates.emplace_back(Candidate{i, j, 0});
+		} else {
+			// only score the images voted by a shared index of features, instead of all pairs
+			pwmatcher.build_retrieval_index(RETRIEVAL_NR_QUERY);
+			vector<vector<int>> similar(n);
+#pragma omp parallel for schedule(dynamic)
+			REP(i, n)
+				similar[i] = pwmatcher.retrieve(i, RETRIEVAL_NR_QUERY, RETRIEVAL_NR_CANDIDATE);
+			set<pair<int, int>> pairs;
+			REP(i, n) for (int j : similar[i])
+				pairs.emplace(min(i, j), max(i, j));
+			for (auto& p : pairs)
+				candidates.emplace_back(Candidate{p.first, p.second, 0});
+			print_debug("Retrieval: %lu candidate pairs\n", candidates.size());
+		}
+#pragma omp parallel for schedule(dynamic)
+		REP(k, (int)candidates.size()) {
+			auto& c = candidates[k];
+			c.score = pwmatcher.count_match(c.i, c.j, RETRIEVAL_NR_QUERY);
+		}
+		sort(candidates.begin(), candidates.end());
+	}
+
+	// spanning tree: match the best candidates connecting different components
+	vector<int> component(n);
+	REP(i, n) component[i] = i;
+	function<int(int)> find = [&](int x) {
+		return component[x] == x ? x : component[x] = find(component[x]);
+	};
+	int nr_component = n;
+	size_t next = 0;
+	const int batch_size = 2 * omp_get_max_threads();
+	while (nr_component > 1 && next < candidates.size()) {
+		vector<pair<int, int>> batch;
+		for (; next < candidates.size() && (int)batch.size() < batch_size; next ++) {
+			auto& c = candidates[next];
+			if (find(c.i) != find(c.j) && c.score > 0)
+				batch.emplace_back(c.i, c.j);
+		}
+		vector<char> succ(batch.size());
+#pragma omp parallel for schedule(dynamic)
+		REP(k, (int)batch.size())
+			succ[k] = match_image(pwmatcher, batch[k].first, batch[k].second);
+		REP(k, batch.size()) {
+			int i = batch[k].first, j = batch[k].second;
+			tried.emplace(i, j);
+			if (succ[k] && find(i) != find(j)) {
+				component[find(i)] = find(j);
+				nr_component --;
+			}
+		}
+	}
+	if (nr_component > 1) {
+		print_debug("Retrieval failed to connect all images, match all pairs\n");
+		vector<pair<int, int>> tasks;
+		REP(i, n) REPL(j, i + 1, n) if (!tried.count(make_pair(i, j))) tasks.emplace_back(i, j);
+#pragma omp parallel for schedule(dynamic)
+		REP(k, (int)tasks.size())
+			match_image(pwmatcher, tasks[k].first, tasks[k].second);
+		return;
+	}
+
+	// cameras estimated on the tree predict the footprint of each image
+	vector<Shape2D> shapes;
+	for (auto& m: imgs) shapes.emplace_back(m.shape());
+	auto tree_cameras = CameraEstimator{pairwise_matches, shapes}.estimate();
+	vector<Vec> axis(n);
+	vector<double> half_fov(n);
+	REP(i, n) {
+		auto& R = tree_cameras[i].R;
+		axis[i] = Vec{R[6], R[7], R[8]};	// optical axis in world
+		half_fov[i] = atan(hypot(shapes[i].halfw(), shapes[i].halfh()) / tree_cameras[i].focal);
+	}
+	// homography from j to i in [-w/2,w/2] coordinate
+	auto homo_between = [&](int i, int j) {
+		Homography Ti = Homography::I(), Tj = Homography::I();
+		Ti[2] = -shapes[i].halfw(), Ti[5] = -shapes[i].halfh();
+		Tj[2] = shapes[j].halfw(), Tj[5] = shapes[j].halfh();
+		auto& ci = tree_cameras[i], &cj = tree_cameras[j];
+		return Ti * ci.K() * ci.R * cj.Rinv() * cj.K().inverse() * Tj;
+	};
+
+	vector<pair<int, int>> tasks;
+	REP(i, n) REPL(j, i + 1, n) {
+		if (tried.count(make_pair(i, j))) continue;
+		double angle = acos(max(min(axis[i].dot(axis[j]), 1.0), -1.0));
+		if (angle >= half_fov[i] + half_fov[j])
+			continue;
+		Homography H = homo_between(i, j);
+		auto overlap = overlap_region(shapes[i], shapes[j], H.to_matrix(), H.inverse());
+		if (overlap.size() >= 3)
+			tasks.emplace_back(i, j);
+	}
+	print_debug("Guided matching: %lu candidate pairs out of %d\n",
+			tasks.size(), n * (n - 1) / 2);
+#pragma omp parallel for schedule(dynamic)
+	REP(k, (int)tasks.size())
+		match_image(pwmatcher, tasks[k].first, tasks[k].second);
+}
+
 void Stitcher::assign_center() {
 	bundle.identity_idx = imgs.size() >> 1;
 	//bundle.identity_idx = 0;
@@ -136,8 +314,15 @@ void Stitcher::assign_center() {
 void Stitcher::estimate_camera() {
 	vector<Shape2D> shapes;
 	for (auto& m: imgs) shapes.emplace_back(m.shape());
-	auto cameras = CameraEstimator{pairwise_matches, shapes}.estimate();
+	if (HIERARCHICAL_CLUSTER_SIZE > 0 && (int)imgs.size() > HIERARCHICAL_CLUSTER_SIZE)
+		cameras = HierarchicalCameraEstimator{
+			pairwise_matches, shapes, max(HIERARCHICAL_CLUSTER_SIZE, 2)}.estimate();
+	else
+		cameras = CameraEstimator{pairwise_matches, shapes}.estimate();
+	camera_to_homo();
+}
 
+void Stitcher::camera_to_homo() {
 	// produced homo operates on [0,w] coordinate
 	REP(i, imgs.size()) {
 		bundle.component[i].homo_inv = cameras[i].K() * cameras[i].R;
@@ -155,14 +340,14 @@ void Stitcher::build_linear_simple() {
 
 	// accumulate the transformations
 	if (mid + 1 < n) {
-		comp[mid+1].homo = pairwise_matches[mid][mid+1].homo;
+		comp[mid+1].homo = pairwise_matches.at(mid, mid+1).homo;
 		REPL(k, mid + 2, n)
-			comp[k].homo = comp[k - 1].homo * pairwise_matches[k-1][k].homo;
+			comp[k].homo = comp[k - 1].homo * pairwise_matches.at(k-1, k).homo;
 	}
 	if (mid - 1 >= 0) {
-		comp[mid-1].homo = pairwise_matches[mid][mid-1].homo;
+		comp[mid-1].homo = pairwise_matches.at(mid, mid-1).homo;
 		REPD(k, mid - 2, 0)
-			comp[k].homo = comp[k + 1].homo * pairwise_matches[k+1][k].homo;
+			comp[k].homo = comp[k + 1].homo * pairwise_matches.at(k+1, k).homo;
 	}
 	// now, comp[k]: from k to identity
 
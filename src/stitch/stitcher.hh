@@ -7,6 +7,9 @@
 #include <vector>
 #include "lib/mat.h"
 #include "lib/utils.hh"
+#include "camera.hh"
+#include "checkpoint.hh"
+#include "match_graph.hh"
 #include "stitcher_image.hh"
 #include "stitcherbase.hh"
 
@@ -23,31 +26,49 @@ class Stitcher : public StitcherBase {
 		// transformation and metadata of each image
 		ConnectedImages bundle;
 
-		// 2d array of all matches
-		// pairwise_matches[i][j].homo transform j to i
-		std::vector<std::vector<MatchInfo>> pairwise_matches;
+		// graph of all matches
+		// pairwise_matches.get(i, j)->homo transform j to i
+		MatchGraph pairwise_matches;
+
+		// estimated cameras. empty if not in ESTIMATE_CAMERA mode
+		std::vector<Camera> cameras;
+
+		// the stage to resume from, using the saved checkpoints
+		CheckpointStage resume_stage = CheckpointStage::None;
+
+		// whether to add the trailing images to the saved checkpoints
+		bool incremental = false;
 
 		// match two images
 		bool match_image(const PairWiseMatcher&, int i, int j);
 
-		// pairwise matching of all images
-		void pairwise_match();
+		// pairwise matching of all images,
+		// only the pairs involving an image after start are matched
+		void pairwise_match(int start = 0);
 		// equivalent to pairwise_match when dealing with linear images
 		void linear_pairwise_match();
 
+		// match a spanning tree found by cheap retrieval,
+		// then only the pairs whose footprints overlap under the cameras of the tree
+		void guided_pairwise_match();
+
 		// assign a center to be identity
 		void assign_center();
 
 		// build by estimating camera parameters
 		void estimate_camera();
 
+		// compute transformations from the estimated cameras
+		void camera_to_homo();
+
+		// register the images unknown to the checkpoints, keep the others fixed
+		void build_incremental();
+
 		// naively build panorama assuming linear imgs
 		void build_linear_simple();
 
 		// for debug
 		void draw_matchinfo();
-		void dump_matchinfo(const char*) const;
-		void load_matchinfo(const char*);
 	public:
 		template<typename U, typename X =
 			disable_if_same_or_derived<Stitcher, U>>
@@ -57,7 +78,20 @@ class Stitcher : public StitcherBase {
 					bundle.component[i].imgptr = &imgs[i];
 			}
 
+		// skip the stages before (and including) s, by loading its checkpoint
+		void resume_from(CheckpointStage s) { resume_stage = s; }
+
+		// the leading images are covered by the checkpoints of a previous run,
+		// only process the others, and update the checkpoints
+		void add_to_checkpoint() { incremental = true; }
+
 		virtual Mat32f build();
+
+		// compute the transformations of all images in bundle, ready to blend
+		void build_bundle();
+
+		// valid after build_bundle()
+		const ConnectedImages& get_bundle() const { return bundle; }
 };
 
 }
@@ -3,6 +3,7 @@
 
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <algorithm>
 #include <iostream>
 #include <cassert>
 #include <memory>
@@ -19,16 +20,48 @@ using namespace config;
 
 namespace pano {
 
+namespace {
+// map pixels of window on the final result to cur by rows, with the projection inlined.
+// see add_images_to()
+template <typename Proj>
+BlenderBase::RowMapper row_mapper(const ConnectedImages& bundle,
+		const ConnectedImages::ImageComponent& cur,
+		const Vec2D& resolution, const ConnectedImages::Window& window) {
+	Vec2D origin = bundle.proj_range.min;
+	Coor offset = window.min;
+	// identity if there is no post_homo
+	Homography post_homo_inv = bundle.has_post_homo ? bundle.post_homo_inv : Homography::I();
+	return [=, &cur](int i, int l, int r, float* rows, float* cols) {
+		// local copies, known to not alias the output
+		const Homography post = post_homo_inv, homo_inv = cur.homo_inv;
+		REPL(j, l, r + 1) {
+			Vec2D c = post.trans2d(Vec2D(j + offset.x, i + offset.y));
+			Vec homo = homo_inv.trans(Proj::proj2homo(c * resolution + origin));
+			// NaN if it's behind the camera
+			double denom = homo.z < 0 ? NAN : 1.0 / homo.z;
+			cols[j - l] = homo.x * denom;
+			rows[j - l] = homo.y * denom;
+		}
+		if (cur.unwarp)
+			REP(k, r - l + 1)
+				if (! std::isnan(cols[k])) {
+					Vec2D p = cur.unwarp(Vec2D(cols[k], rows[k]));
+					cols[k] = p.x, rows[k] = p.y;
+				}
+	};
+}
+}
+
 void ConnectedImages::shift_all_homo() {
 	int mid = identity_idx;
 	Homography t2 = Homography::get_translation(
-			component[mid].imgptr->width() * 0.5,
-			component[mid].imgptr->height() * 0.5);
+			component[mid].width() * 0.5,
+			component[mid].height() * 0.5);
 	REP(i, (int)component.size())
 		if (i != mid) {
 			Homography t1 = Homography::get_translation(
-					component[i].imgptr->width() * 0.5,
-					component[i].imgptr->height() * 0.5);
+					component[i].width() * 0.5,
+					component[i].height() * 0.5);
 			component[i].homo = t2 * component[i].homo * t1.inverse();
 		}
 }
@@ -53,7 +86,7 @@ void ConnectedImages::update_proj_range() {
 					now_max = now_min * (-1);
 		for (auto v : corner) {
 			Vec homo = m.homo.trans(
-					Vec2D(v.x * m.imgptr->width(), v.y * m.imgptr->height()));
+					Vec2D(v.x * m.width(), v.y * m.height()));
 			Vec2D t_corner = homo2proj(homo);
 			now_min.update_min(t_corner);
 			now_max.update_max(t_corner);
@@ -69,8 +102,8 @@ void ConnectedImages::update_proj_range() {
 }
 
 Vec2D ConnectedImages::get_final_resolution() const {
-	int refw = component[identity_idx].imgptr->width(),
-			refh = component[identity_idx].imgptr->height();
+	int refw = component[identity_idx].width(),
+			refh = component[identity_idx].height();
 	auto homo2proj = get_homo2proj();
 
 	Vec2D id_img_range = homo2proj(Vec(refw, refh, 1)) - homo2proj(Vec(0, 0, 1));
@@ -86,7 +119,16 @@ Vec2D ConnectedImages::get_final_resolution() const {
 				target_size = proj_range.size() / resolution;
 	double max_edge = max(target_size.x, target_size.y);
   print_debug("Target Image Size: (%lf, %lf)\n", target_size.x, target_size.y);
-	if (max_edge > 80000 || target_size.x * target_size.y > 1e9)
+	double max_area = 1e9;
+	if (STREAM_BLEND) {
+		// memory is not a limit, but the result can't be much larger than all inputs together
+		double input_area = 0;
+		for (auto& m : component)
+			input_area += (double)m.width() * m.height();
+		update_max(max_area, input_area * 10);
+	} else if (max_edge > 80000)
+		error_exit("Target size too large. Looks like a stitching failure!\n");
+	if (target_size.x * target_size.y > max_area)
 		error_exit("Target size too large. Looks like a stitching failure!\n");
 	// resize the result
 	if (max_edge > MAX_OUTPUT_SIZE) {
@@ -96,44 +138,204 @@ Vec2D ConnectedImages::get_final_resolution() const {
 	return resolution;
 }
 
-Mat32f ConnectedImages::blend() const {
-	GuardedTimer tm("blend()");
-	// it's hard to do coordinates.......
-	auto proj2homo = get_proj2homo();
-	Vec2D resolution = get_final_resolution();
+ConnectedImages::Window ConnectedImages::get_crop_window(const Vec2D& resolution) const {
+	GuardedTimer tm("get_crop_window()");
+	Vec2D size_d = proj_range.size() / resolution;
+	int w = size_d.x, h = size_d.y;
+	auto homo2proj = get_homo2proj();
+
+	// x of cylindrical and spherical projection is a longitude in (-pi, pi],
+	// so a border crossing the back of the sphere jumps by a period on the result
+	double period = proj_method == ProjectionMethod::flat ? 0 : 2 * M_PI / resolution.x;
+	// make a border continuous across the seam, so it's a polygon extending out of [0, w).
+	// if it doesn't close that way, it goes around a pole, and covers all between it and the pole
+	auto unwrap_border = [&](const ImageComponent& m, vector<Vec2D>& border) {
+		auto unwrap = [&](double& x, double prev) {
+			while (x - prev > period * 0.5) x -= period;
+			while (prev - x > period * 0.5) x += period;
+		};
+		int n = border.size();
+		REPL(k, 1, n)
+			unwrap(border[k].x, border[k - 1].x);
+		Vec2D end = border[0];
+		unwrap(end.x, border[n - 1].x);
+		if (fabs(end.x - border[0].x) < period * 0.5)
+			return;
+		// the image sees the north pole if the up direction is in front of it, within its borders
+		Vec up = m.homo_inv.trans(Vec(0, -1, 0));
+		bool north = up.z > 0 &&
+			between(up.x / up.z, 0, m.width()) && between(up.y / up.z, 0, m.height());
+		double pole_y = north ? -1 : h + 1;
+		border.emplace_back(end);
+		border.emplace_back(end.x, pole_y);
+		border.emplace_back(border[0].x, pole_y);
+	};
+
+	// borders of the images on the final result
+	const static int BORDER_SAMPLE = 100;
+	vector<vector<Vec2D>> borders;
+	for (auto& m : component) {
+		vector<Vec2D> border;
+		if (m.unwarp)
+			border = m.warped_border;
+		else {
+			double mw = m.width() - 1, mh = m.height() - 1;
+			Vec2D corner[4] = {Vec2D(0, 0), Vec2D(mw, 0), Vec2D(mw, mh), Vec2D(0, mh)};
+			REP(k, 4) REP(i, BORDER_SAMPLE)
+				border.emplace_back(corner[k] + (corner[(k + 1) % 4] - corner[k]) * ((double)i / BORDER_SAMPLE));
+		}
+		for (auto& p : border) {
+			p = (homo2proj(m.homo.trans(p)) - proj_range.min) / resolution;
+			if (has_post_homo)
+				p = post_homo.trans2d(p);
+		}
+		if (period > 0)
+			unwrap_border(m, border);
+		borders.emplace_back(move(border));
+	}
+
+	// covered spans of each row, by scanning the border polygons.
+	// a margin is left for the error of sampling the borders
+	const static int MARGIN = 2;
+	vector<vector<pair<int, int>>> spans(h);
+#pragma omp parallel for schedule(dynamic)
+	REP(y, h) {
+		vector<double> xs;
+		for (auto& border : borders) {
+			xs.clear();
+			int n = border.size();
+			REP(k, n) {
+				auto &a = border[k], &b = border[(k + 1) % n];
+				if ((a.y <= y) != (b.y <= y))
+					xs.emplace_back(a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y));
+			}
+			sort(xs.begin(), xs.end());
+			// an unwrapped border also covers its copies by periods away
+			int nr_shift = period > 0 ? 2 : 0;
+			for (int shift = -nr_shift; shift <= nr_shift; shift ++)
+				for (size_t k = 0; k + 1 < xs.size(); k += 2) {
+					int l = max((int)ceil(xs[k] + shift * period) + MARGIN, 0),
+							r = min((int)floor(xs[k + 1] + shift * period) - MARGIN, w - 1);
+					if (l <= r)
+						spans[y].emplace_back(l, r);
+				}
+		}
+	}
+
+	Window ret;
+	largest_rectangle(w, h, [&](int y, vector<char>& valid) {
+				std::fill(valid.begin(), valid.end(), 0);
+				for (auto& s : spans[y])
+					std::fill(valid.begin() + s.first, valid.begin() + s.second + 1, 1);
+			}, ret.min, ret.max);
+	print_debug("Crop from %dx%d to %dx%d\n", h, w, ret.size().y, ret.size().x);
+	return ret;
+}
 
+ConnectedImages::Window ConnectedImages::get_window(
+		const Vec2D& resolution, bool crop) const {
+	if (crop)
+		return get_crop_window(resolution);
 	Vec2D size_d = proj_range.size() / resolution;
-	Coor size(size_d.x, size_d.y);
+	return Window{Coor(0, 0), Coor(size_d.x, size_d.y)};
+}
+
+void ConnectedImages::add_images_to(BlenderBase& blender,
+		const Vec2D& resolution, const Window& window) const {
+	// it's hard to do coordinates.......
+	auto proj2homo = get_proj2homo();
+	Coor size = window.size();
 	print_debug("Final Image Size: (%d, %d)\n", size.x, size.y);
 
 	auto scale_coor_to_img_coor = [&](Vec2D v) {
 		v = (v - proj_range.min) / resolution;
 		return Coor(v.x, v.y);
 	};
+	// bounding box of the transformed range
+	auto post_range = [&](const Range& r, Coor& top_left, Coor& bottom_right) {
+		Vec2D a = (r.min - proj_range.min) / resolution,
+					b = (r.max - proj_range.min) / resolution;
+		Vec2D lo = Vec2D::max(), hi = lo * (-1);
+		for (auto& p : {a, Vec2D(a.x, b.y), Vec2D(b.x, a.y), b}) {
+			Vec2D q = post_homo.trans2d(p);
+			lo.update_min(q), hi.update_max(q);
+		}
+		top_left = Coor(floor(lo.x), floor(lo.y));
+		bottom_right = Coor(ceil(hi.x), ceil(hi.y));
+	};
 
-	// blending
-	std::unique_ptr<BlenderBase> blender;
-	if (MULTIBAND > 0)
-		blender.reset(new MultiBandBlender{MULTIBAND});
-	else
-		blender.reset(new LinearBlender);
 	for (auto& cur : component) {
-		Coor top_left = scale_coor_to_img_coor(cur.range.min);
-		Coor bottom_right = scale_coor_to_img_coor(cur.range.max);
+		Coor top_left, bottom_right;
+		if (has_post_homo)
+			post_range(cur.range, top_left, bottom_right);
+		else {
+			top_left = scale_coor_to_img_coor(cur.range.min);
+			bottom_right = scale_coor_to_img_coor(cur.range.max);
+		}
+		top_left = top_left - window.min;
+		bottom_right = bottom_right - window.min;
+		top_left.update_max(Coor(0, 0));
+		bottom_right.update_min(size);
+		// an image across the seam of a 360 degree result is sampled on both ends,
+		// but the samples miss what it covers right next to the seam
+		if (proj_method != ProjectionMethod::flat && cur.range.size().x > M_PI)
+			top_left.x = 0, bottom_right.x = size.x;
+		if (top_left.x > bottom_right.x || top_left.y > bottom_right.y)
+			continue;		// outside the window
 
-		blender->add_image(top_left, bottom_right, *cur.imgptr,
+		BlenderBase::RowMapper row_func;
+		switch (proj_method) {
+			case ProjectionMethod::flat:
+				row_func = row_mapper<FlatProjection>(*this, cur, resolution, window);
+				break;
+			case ProjectionMethod::cylindrical:
+				row_func = row_mapper<CylindricalProjection>(*this, cur, resolution, window);
+				break;
+			case ProjectionMethod::spherical:
+				row_func = row_mapper<SphericalProjection>(*this, cur, resolution, window);
+				break;
+		}
+		blender.add_image(top_left, bottom_right, *cur.imgptr,
 				[=,&cur](Coor t) -> Vec2D {
-					Vec2D c = Vec2D(t.x, t.y) * resolution + proj_range.min;
-					Vec homo = proj2homo(Vec2D(c.x, c.y));
-					Vec ret = cur.homo_inv.trans(homo);
-					if (ret.z < 0)
-						return Vec2D{-10, -10};	// was projected to the other side of the lens, discard
-					double denom = 1.0 / ret.z;
-					return Vec2D{ret.x*denom, ret.y*denom};
-				});
+					Vec2D c(t.x + window.min.x, t.y + window.min.y);
+					if (has_post_homo)
+						c = post_homo_inv.trans2d(c);
+					c = c * resolution + proj_range.min;
+					return cur.homo_to_image(proj2homo(c));
+				}, row_func);
 	}
-	//dynamic_cast<LinearBlender*>(blender.get())->debug_run(size.x, size.y);	// for debug
+}
+
+Mat32f ConnectedImages::blend(bool crop) const {
+	GuardedTimer tm("blend()");
+	Vec2D resolution = get_final_resolution();
+	Window window = get_window(resolution, crop);
+	std::unique_ptr<BlenderBase> blender;
+	if (MULTIBAND > 0 && MULTIBAND_HALF)
+		blender.reset(new HalfMultiBandBlender{MULTIBAND});
+	else if (MULTIBAND > 0)
+		blender.reset(new MultiBandBlender{MULTIBAND});
+	else
+		blender.reset(new LinearBlender{window.size()});
+	add_images_to(*blender, resolution, window);
+	//auto lb = dynamic_cast<LinearBlender*>(blender.get()); lb->debug_run(lb->size().x, lb->size().y);	// for debug
 	return blender->run();
 }
 
+void ConnectedImages::blend(const char* fname, bool crop) const {
+	GuardedTimer tm("blend()");
+	Vec2D resolution = get_final_resolution();
+	Window window = get_window(resolution, crop);
+	Coor size = window.size();
+	std::unique_ptr<BlenderBase> blender;
+	if (MULTIBAND > 0 && MULTIBAND_HALF)
+		blender.reset(new HalfMultiBandBlender{MULTIBAND, size});
+	else if (MULTIBAND > 0)
+		blender.reset(new MultiBandBlender{MULTIBAND, size});
+	else
+		blender.reset(new LinearBlender{size});
+	add_images_to(*blender, resolution, window);
+	blender->run_strips(*StripWriter::create(fname, size.x, size.y));
+}
+
 }
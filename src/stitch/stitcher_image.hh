@@ -4,6 +4,7 @@
 #pragma once
 #include <vector>
 #include <cassert>
+#include <functional>
 #include "lib/mat.h"
 #include "projection.hh"
 #include "homography.hh"
@@ -11,6 +12,8 @@
 
 namespace pano {
 
+class BlenderBase;
+
 /// A group of connected images, and metadata for stitching
 struct ConnectedImages {
 	ConnectedImages() = default;
@@ -44,12 +47,40 @@ struct ConnectedImages {
 		// range after projected to identity frame
 		Range range;
 
+		// if set, homo operates on a warped image of shape warped_shape,
+		// and unwarp maps the warped coordinate back to the original image
+		std::function<Vec2D(Vec2D)> unwarp;
+		Coor warped_shape;
+		// border of the original image on the warped one, as a polygon
+		std::vector<Vec2D> warped_border;
+
 		ImageComponent(){}
 		ImageComponent(ImageRef* img):imgptr(img) {}
+
+		// shape of the image homo operates on
+		int width() const { return unwarp ? warped_shape.x : imgptr->width(); }
+		int height() const { return unwarp ? warped_shape.y : imgptr->height(); }
+
+		// map a point in the identity frame to the original image.
+		// return (-10, -10) if it's behind the camera
+		Vec2D homo_to_image(const Vec& homo) const {
+			Vec ret = homo_inv.trans(homo);
+			if (ret.z < 0)
+				return Vec2D{-10, -10};	// was projected to the other side of the lens, discard
+			double denom = 1.0 / ret.z;
+			Vec2D p{ret.x*denom, ret.y*denom};
+			return unwarp ? unwarp(p) : p;
+		}
 	};
 
 	std::vector<ImageComponent> component;
 
+	// if set, the final result is transformed by post_homo at blending time,
+	// e.g. by the perspective correction in cylinder mode.
+	// it maps a pixel of the result to the transformed one, and post_homo_inv the reverse
+	bool has_post_homo = false;
+	Homography post_homo, post_homo_inv;
+
 	// update range of projection of all transformations
 	void update_proj_range();
 
@@ -85,9 +116,31 @@ struct ConnectedImages {
 	// inverse all homographies
 	void calc_inverse_homo();
 
-	Mat32f blend() const;
+	// a rectangle [min, max) on the final result
+	struct Window {
+		Coor min, max;
+		Coor size() const { return max - min; }
+	};
+
+	// blend the final result. if crop, only blend the window from get_crop_window()
+	Mat32f blend(bool crop = false) const;
+
+	// blend by strips and write them to fname, without holding the whole result
+	void blend(const char* fname, bool crop = false) const;
 
 	Vec2D get_final_resolution() const;
+
+	// the largest rectangle on the final result covered by images,
+	// computed from their projected borders, before blending anything
+	Window get_crop_window(const Vec2D& resolution) const;
+
+	private:
+	// the whole final result, or the crop window
+	Window get_window(const Vec2D& resolution, bool crop) const;
+
+	// add all images to blender, with their ranges on window
+	void add_images_to(BlenderBase& blender,
+			const Vec2D& resolution, const Window& window) const;
 };
 
 }
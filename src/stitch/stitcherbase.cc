@@ -3,23 +3,34 @@
 
 #include "stitcherbase.hh"
 #include "lib/timer.hh"
+#include "lib/prefetcher.hh"
 
 namespace pano {
 
-void StitcherBase::calc_feature() {
+void StitcherBase::calc_feature(int start) {
 	GuardedTimer tm("calc_feature()");
 	feats.resize(imgs.size());
 	keypoints.resize(imgs.size());
+	// full-colour image is not needed until blending
+	std::vector<Mat32f> greys(imgs.size());
+	int working_size = feature_det->working_size();
+	Prefetcher prefetcher(imgs.size() - start, [&](int i) {
+		int k = i + start;
+		greys[k] = imgs[k].load_grey(working_size);
+		return (size_t)greys[k].pixels() * sizeof(float);
+	}, (size_t)config::PREFETCH_MEMORY << 20, config::PREFETCH_NR_THREAD);
 	// detect feature
 #pragma omp parallel for schedule(dynamic)
-	REP(k, imgs.size()) {
-		imgs[k].load();
-		feats[k] = feature_det->detect_feature(*imgs[k].img);
-		if (config::LAZY_READ)
-			imgs[k].release();
+	REPL(k, start, (int)imgs.size()) {
+		prefetcher.wait(k - start);
+		feats[k] = feature_det->detect_feature(greys[k], imgs[k].width(), imgs[k].height());
+		greys[k] = Mat32f();
+		prefetcher.done(k - start);
 		if (feats[k].size() == 0)
-			error_exit(ssprintf("Cannot find feature in image %lu!\n", k));
-		print_debug("Image %lu has %lu features\n", k, feats[k].size());
+			error_exit(ssprintf("Cannot find feature in image %d!\n", k));
+		print_debug("Image %d has %lu features\n", k, feats[k].size());
+	}
+	REP(k, imgs.size()) {
 		keypoints[k].resize(feats[k].size());
 		REP(i, feats[k].size())
 			keypoints[k][i] = feats[k][i].coor;
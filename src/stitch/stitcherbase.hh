@@ -35,8 +35,9 @@ class StitcherBase {
 		// feature detector
 		std::unique_ptr<FeatureDetector> feature_det;
 
-		// get feature descriptor and keypoints for each image
-		void calc_feature();
+		// get feature descriptor and keypoints for each image,
+		// detecting only for images after start (whose feats are already known)
+		void calc_feature(int start = 0);
 
 		void free_feature();
 
@@ -46,7 +46,7 @@ TransformEstimation::TransformEstimation(const MatchData& m_match,
 	ransac_inlier_thres = (shape1.w + shape1.h) * 0.5 / 800 * RANSAC_INLIER_THRES;
 }
 
-bool TransformEstimation::get_transform(MatchInfo* info) {
+bool TransformEstimation::get_transform(MatchInfo* info, vector<int>* inliers_out) {
 	TotalTimer tm("get_transform");
 	// use Affine in cylinder mode, and Homography in normal mode
 	// TODO more condidate set will require more ransac iterations
@@ -83,6 +83,8 @@ bool TransformEstimation::get_transform(MatchInfo* info) {
 			best_transform = move(transform);
 	}
 	inliers = get_inliers(best_transform);
+	if (inliers_out)
+		*inliers_out = inliers;
 	return fill_inliers_to_matchinfo(inliers, info);
 }
 
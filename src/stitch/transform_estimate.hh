@@ -26,8 +26,14 @@ class TransformEstimation {
 		TransformEstimation(const TransformEstimation&) = delete;
 		TransformEstimation& operator = (const TransformEstimation&) = delete;
 
-		// get a transform matix from second(f2) -> first(f1)
-		bool get_transform(MatchInfo* info);
+		// get a transform matix from second(f2) -> first(f1).
+		// if inliers is given, fill it with the indices of inlier matches
+		bool get_transform(MatchInfo* info, std::vector<int>* inliers = nullptr);
+
+		// fit a transform from second(f2) -> first(f1) on the given matches
+		// by least squares, without RANSAC
+		Homography fit(const std::vector<int>& matches) const
+		{ return calc_transform(matches); }
 
 		enum TransformType { Affine, Homo };
 
@@ -5,6 +5,7 @@
 
 #include "warp.hh"
 #include "lib/imgproc.hh"
+#include "lib/sampler.hh"
 using namespace std;
 using namespace pano;
 
@@ -26,18 +27,18 @@ Mat32f CylinderProject::project(const Mat32f& img, vector<Vec2D>& pts) const {
 	Shape2D shape{img.width(), img.height()};
 	Vec2D offset = project(shape, pts);
 
-	real_t sizefactor_inv = 1.0 / sizefactor;
-
+	// pixels out of img are written as Color::NO by the sampler
 	Mat32f mat(shape.h, shape.w, 3);
-	fill(mat, Color::NO);
 #pragma omp parallel for schedule(dynamic)
-	REP(i, mat.height()) REP(j, mat.width()) {
-		Vec2D oricoor = proj_r((Vec2D(j, i) - offset) * sizefactor_inv);
-		if (between(oricoor.x, 0, img.width()) && between(oricoor.y, 0, img.height())) {
-			Color c = interpolate(img, oricoor.y, oricoor.x);
-			float* p = mat.ptr(i, j);
-			p[0] = c.x, p[1] = c.y, p[2] = c.z;
+	REP(i, mat.height()) {
+		int w = mat.width();
+		vector<float> rs(w), cs(w);
+		vector<unsigned char> valid(w);
+		REP(j, w) {
+			Vec2D oricoor = unproject(Vec2D(j, i), offset);
+			rs[j] = oricoor.y, cs[j] = oricoor.x;
 		}
+		sample_row(img, rs.data(), cs.data(), w, mat.ptr(i), valid.data(), config_interpolation());
 	}
 
 	return mat;
@@ -46,7 +47,11 @@ Mat32f CylinderProject::project(const Mat32f& img, vector<Vec2D>& pts) const {
 Vec2D CylinderProject::project(Shape2D& shape, std::vector<Vec2D>& pts) const {
 	Vec2D min(numeric_limits<real_t>::max(), numeric_limits<real_t>::max()),
 				max(0, 0);
-	REP(i, shape.h) REP(j, shape.w) {			// TODO finally: only use rect corners
+	// x is monotonic in j, and y in i. for a fixed i, y is monotonic in |j - center.x|.
+	// so the bounds over all pixels are reached on the top and bottom rows,
+	// at the two ends and at the column closest to center
+	int cx = std::max(0, std::min((int)center.x, shape.w - 1));
+	for (int i : {0, shape.h - 1}) for (int j : {0, cx, shape.w - 1}) {
 		Vec2D newcoor = proj(Vec2D(j, i));
 		min.update_min(newcoor), max.update_max(newcoor);
 	}
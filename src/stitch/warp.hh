@@ -3,6 +3,7 @@
 // Author: Yuxin Wu <ppwwyyxxc@gmail.com>
 
 #pragma once
+#include <functional>
 #include "lib/geometry.hh"
 #include "lib/mat.h"
 #include "feature/feature.hh"
@@ -27,6 +28,10 @@ class CylinderProject {
 		// return the projected image offset
 		Vec2D project(Shape2D& shape, std::vector<Vec2D>& pts) const;
 
+		// map a coordinate on the projected image back to the original image
+		inline Vec2D unproject(const Vec2D& p, const Vec2D& offset) const
+		{ return proj_r((p - offset) * (1.0 / sizefactor)); }
+
 	private:
 		// return (angle with x) and (angle vertical)
 		Vec2D proj(const Vec& p) const;
@@ -53,6 +58,15 @@ class CylinderWarper {
 			get_projector(shape.w, shape.h).project(shape, kpts);
 		}
 
+		// warp keypoints given image shape, without touching the pixels.
+		// return the function mapping warped coordinate back to the original image
+		std::function<Vec2D(Vec2D)> warp_coor(
+				Shape2D& shape, std::vector<Vec2D>& kpts) const {
+			auto projector = get_projector(shape.w, shape.h);
+			Vec2D offset = projector.project(shape, kpts);
+			return [=](Vec2D p) { return projector.unproject(p, offset); };
+		}
+
 		// warp image only
 		inline void warp(Mat32f& mat) const {
 			std::vector<Vec2D> a;